@@ -0,0 +1,109 @@
+// Relay thread placement next to the active connection's msquic worker,
+// shared by quic_client.c and quic_server.c (both define _GNU_SOURCE).
+//
+// msquic reports a connection's ideal processor with
+// QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED. The worker thread only
+// records it with relay_placement_request(); the select() loop applies it to
+// itself in relay_placement_poll(), so no other thread ever touches the relay
+// thread's affinity or placement state.
+//
+// The relay is pinned to the CPUs sharing the ideal processor's last-level
+// cache (or its package when sysfs has no cache info), minus the ideal
+// processor's own core and its SMT siblings. The relay loop and the worker
+// stay cache-close without competing for one core. If nothing is left (small
+// machines) the relay is not pinned.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+
+static int relay_placement_requested = -1;  // Written by msquic workers, read by the relay loop
+static int relay_placement_cpu = -1;        // Relay loop only
+
+// Parses a sysfs CPU list such as "0-3,8-11" into set. Returns false if the file is unreadable.
+static inline bool cpu_list_read(const char* path, cpu_set_t* set) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char list[1024];
+    bool ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    if (!ok) {
+        return false;
+    }
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+// CPUs that share the last-level cache with cpu, excluding cpu's own core.
+static inline bool relay_placement_set(int cpu, cpu_set_t* set) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list", cpu);
+    if (!cpu_list_read(path, set)) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_siblings_list", cpu);
+        if (!cpu_list_read(path, set)) {
+            return false;
+        }
+    }
+    cpu_set_t core;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (!cpu_list_read(path, &core)) {
+        CPU_ZERO(&core);
+        CPU_SET(cpu, &core);
+    }
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET(i, &core)) {
+            CPU_CLR(i, set);
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+// msquic worker thread: remember the active connection's ideal processor.
+static inline void relay_placement_request(int cpu) {
+    __atomic_store_n(&relay_placement_requested, cpu, __ATOMIC_RELAXED);
+}
+
+// Relay (select() loop) thread: move next to the last requested processor.
+static inline void relay_placement_poll() {
+    int cpu = __atomic_load_n(&relay_placement_requested, __ATOMIC_RELAXED);
+    if (cpu < 0 || cpu == relay_placement_cpu) {
+        return;
+    }
+    relay_placement_cpu = cpu;
+    cpu_set_t set;
+    if (!relay_placement_set(cpu, &set)) {
+        printf("[CPU] No CPU shares a cache with CPU %d outside its core; relay thread left unpinned.\n", cpu);
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("[CPU][ERROR] sched_setaffinity");
+        return;
+    }
+    printf("[CPU] Relay thread pinned next to CPU %d (%d CPUs sharing its cache).\n", cpu, CPU_COUNT(&set));
+}
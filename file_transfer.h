@@ -0,0 +1,29 @@
+// Bulk file transfer framing shared by quic_client.c and quic_server.c.
+//
+// Transfers run on their own connections, negotiated with FILE_TRANSFER_ALPN
+// so the server never mistakes them for the relay. One transfer is one
+// client-initiated bidirectional stream carrying a file_transfer_header, the
+// destination file name (name_len bytes, no NUL), exactly `size` bytes of file
+// content, and FIN. The server writes the content at stream offset -
+// (header + name), so it never reassembles it. Once the file is complete and
+// closed it answers with the single byte FILE_TRANSFER_STATUS_OK and FIN;
+// any failure aborts the stream with one of the error codes below instead.
+
+#pragma once
+
+#include <stdint.h>
+
+#define FILE_TRANSFER_MAGIC 0x51465846u // "QFXF"
+#define FILE_TRANSFER_MAX_NAME 255
+#define FILE_TRANSFER_ALPN "chow-file"
+#define FILE_TRANSFER_STATUS_OK 'K'
+
+// Application error codes the server aborts a transfer's stream with
+#define FILE_TRANSFER_ERROR_REJECTED 1  // Bad header or name, or the file could not be written
+#define FILE_TRANSFER_ERROR_SHED 2      // Dropped by the server's load shedder
+
+typedef struct file_transfer_header {
+    uint32_t magic;     // Big-endian
+    uint32_t name_len;  // Big-endian
+    uint64_t size;      // Big-endian
+} file_transfer_header;
@@ -0,0 +1,332 @@
+// Optional per-chunk relay latency tracing, shared by quic_client.c and quic_server.c.
+//
+// Build BOTH sides with -DLATENCY_TRACE=1. Every chunk written to the QUIC
+// stream is then prefixed with an 8-byte latency_chunk_header, and the
+// receiver strips it again before the TCP write(). One in
+// LATENCY_TRACE_SAMPLE_EVERY chunks is sampled: its header has
+// LATENCY_CHUNK_SAMPLED set and is followed by the sender's timestamps. The
+// header is written into room the caller leaves in front of its read buffer,
+// so unsampled chunks cost 8 bytes on the wire and no allocation.
+//
+// Stages (all in nanoseconds, recorded into HDR-style log-linear histograms):
+//   tcp_read->send     sender: TCP read() returned -> StreamSend() called
+//   send->complete     sender: StreamSend() -> QUIC_STREAM_EVENT_SEND_COMPLETE
+//   send->peer_recv    StreamSend() on sender -> QUIC_STREAM_EVENT_RECEIVE on
+//                      receiver (CLOCK_REALTIME, only meaningful with NTP/PTP)
+//   peer_recv->write   receiver: RECEIVE event -> TCP write() returned
+//   end_to_end         sender TCP read() -> receiver TCP write() returned
+//                      (CLOCK_REALTIME, like send->peer_recv)
+// Same-host stages use CLOCK_MONOTONIC; only the stamps that cross hosts are
+// converted to CLOCK_REALTIME.
+//
+// A chunk header with a bad magic means the stream's framing is lost, so
+// latency_rx_feed() fails and the caller aborts the stream with
+// LATENCY_TRACE_ERROR_FRAMING rather than relay misparsed bytes.
+//
+// Send SIGUSR1 to a running relay to dump the histograms to stdout.
+
+#pragma once
+
+#ifndef LATENCY_TRACE
+#define LATENCY_TRACE 0
+#endif
+
+#if LATENCY_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#ifndef LATENCY_TRACE_SAMPLE_EVERY
+#define LATENCY_TRACE_SAMPLE_EVERY 64
+#endif
+
+#define LATENCY_TRACE_MAGIC 0x4c545243u // "LTRC"
+#define LATENCY_CHUNK_SAMPLED 0x80000000u // In latency_chunk_header.length: latency_chunk_stamps follow
+#define LATENCY_TRACE_ERROR_FRAMING 0x4c54 // Stream abort code when a chunk header is corrupt
+
+#define LATENCY_STAGE_SEND_QUEUE 0
+#define LATENCY_STAGE_SEND_COMPLETE 1
+#define LATENCY_STAGE_NETWORK 2
+#define LATENCY_STAGE_TCP_WRITE 3
+#define LATENCY_STAGE_END_TO_END 4
+#define LATENCY_STAGE_COUNT 5
+
+static const char* const latency_stage_names[LATENCY_STAGE_COUNT] = {
+    "tcp_read->send",
+    "send->complete",
+    "send->peer_recv",
+    "peer_recv->write",
+    "end_to_end",
+};
+
+// Wire header in front of every chunk. All fields are big-endian.
+typedef struct latency_chunk_header {
+    uint32_t magic;
+    uint32_t length;     // Payload bytes after the header (and stamps), | LATENCY_CHUNK_SAMPLED
+} latency_chunk_header;
+
+// Follows the header of sampled chunks only. CLOCK_REALTIME, big-endian.
+typedef struct latency_chunk_stamps {
+    uint64_t t_read_ns;  // Sender TCP read() time
+    uint64_t t_send_ns;  // Sender StreamSend() time
+} latency_chunk_stamps;
+
+// Bytes a sender must leave free in front of every payload it frames
+#define LATENCY_HEADER_ROOM (sizeof(latency_chunk_header) + sizeof(latency_chunk_stamps))
+
+// Log-linear histogram: values below 2^SUB_BITS are exact, above that each
+// power of two is split into 2^SUB_BITS buckets (~3% relative error).
+#define LATENCY_HIST_SUB_BITS 5
+#define LATENCY_HIST_SUB_COUNT (1u << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB_COUNT)
+
+typedef struct latency_histogram {
+    uint64_t counts[LATENCY_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} latency_histogram;
+
+static latency_histogram latency_histograms[LATENCY_STAGE_COUNT];
+static uint64_t latency_chunk_counter = 0;
+static volatile sig_atomic_t latency_dump_requested = 0;
+
+// CLOCK_MONOTONIC: every timestamp taken by the relays
+static inline uint64_t latency_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Converts a latency_now_ns() value to CLOCK_REALTIME, for stamps that cross hosts
+static inline uint64_t latency_wall_ns(uint64_t mono_ns) {
+    struct timespec wall, mono;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t offset = ((int64_t)wall.tv_sec - (int64_t)mono.tv_sec) * 1000000000LL +
+                     ((int64_t)wall.tv_nsec - (int64_t)mono.tv_nsec);
+    return mono_ns + (uint64_t)offset;
+}
+
+static inline uint32_t latency_hist_index(uint64_t value) {
+    if (value < LATENCY_HIST_SUB_COUNT) {
+        return (uint32_t)value;
+    }
+    uint32_t shift = (63 - __builtin_clzll(value)) - LATENCY_HIST_SUB_BITS;
+    return (shift + 1) * LATENCY_HIST_SUB_COUNT + (uint32_t)((value >> shift) - LATENCY_HIST_SUB_COUNT);
+}
+
+static inline uint64_t latency_hist_value(uint32_t index) {
+    if (index < 2 * LATENCY_HIST_SUB_COUNT) {
+        return index;
+    }
+    uint32_t shift = index / LATENCY_HIST_SUB_COUNT - 1;
+    return (uint64_t)(LATENCY_HIST_SUB_COUNT + index % LATENCY_HIST_SUB_COUNT) << shift;
+}
+
+// Called from both the select() loop and msquic worker threads.
+static inline void latency_record(int stage, uint64_t start_ns, uint64_t end_ns) {
+    if (start_ns == 0 || end_ns < start_ns) {
+        return;
+    }
+    uint64_t value = end_ns - start_ns;
+    latency_histogram* h = &latency_histograms[stage];
+    __atomic_fetch_add(&h->counts[latency_hist_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    uint64_t prev = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > prev &&
+           !__atomic_compare_exchange_n(&h->max, &prev, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline uint64_t latency_percentile(const latency_histogram* h, uint64_t total, double pct) {
+    uint64_t target = (uint64_t)(total * pct / 100.0);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; ++i) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            return latency_hist_value(i);
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+static inline void latency_dump() {
+    printf("[TRACE] ===== Relay latency (us), 1 in %d chunks sampled =====\n", LATENCY_TRACE_SAMPLE_EVERY);
+    printf("[TRACE] %-18s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+        const latency_histogram* h = &latency_histograms[s];
+        uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+        if (total == 0) {
+            printf("[TRACE] %-18s %10d\n", latency_stage_names[s], 0);
+            continue;
+        }
+        printf("[TRACE] %-18s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", latency_stage_names[s],
+               (unsigned long long)total,
+               latency_percentile(h, total, 50.0) / 1000.0,
+               latency_percentile(h, total, 90.0) / 1000.0,
+               latency_percentile(h, total, 99.0) / 1000.0,
+               latency_percentile(h, total, 99.9) / 1000.0,
+               __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000.0);
+    }
+    fflush(stdout);
+}
+
+static void latency_dump_signal(int sig) {
+    (void)sig;
+    latency_dump_requested = 1;
+}
+
+// No SA_RESTART: select() returns EINTR so the main loop dumps promptly.
+static inline void latency_trace_init() {
+    struct sigaction sa = {0};
+    sa.sa_handler = latency_dump_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    printf("[TRACE] Latency tracing enabled (1 in %d chunks). Send SIGUSR1 to dump histograms.\n",
+           LATENCY_TRACE_SAMPLE_EVERY);
+}
+
+static inline void latency_trace_poll() {
+    if (latency_dump_requested) {
+        latency_dump_requested = 0;
+        latency_dump();
+    }
+}
+
+// ---- Sender side ----
+
+// Sampled chunks only: pass as the StreamSend() ClientContext, freed by
+// latency_send_complete() on QUIC_STREAM_EVENT_SEND_COMPLETE.
+typedef struct latency_send_ctx {
+    uint64_t t_send_ns;
+} latency_send_ctx;
+
+// Writes the chunk header into the LATENCY_HEADER_ROOM bytes in front of
+// payload and returns where the framed chunk starts; *framed_len gets its
+// length. *ctx is set for sampled chunks and NULL for the rest.
+static inline uint8_t* latency_send_frame(uint8_t* payload, uint32_t length, uint64_t t_read_ns,
+                                          uint32_t* framed_len, latency_send_ctx** ctx) {
+    bool sampled = (latency_chunk_counter++ % LATENCY_TRACE_SAMPLE_EVERY) == 0;
+    latency_chunk_header header = {
+        .magic = htonl(LATENCY_TRACE_MAGIC),
+        .length = htonl(length | (sampled ? LATENCY_CHUNK_SAMPLED : 0))
+    };
+    uint8_t* start = payload - sizeof(header);
+    *ctx = NULL;
+    if (sampled) {
+        *ctx = malloc(sizeof(**ctx));
+        if (*ctx == NULL) {
+            fprintf(stderr, "[TRACE][ERROR] Out of memory for send context\n");
+            exit(1);
+        }
+        (*ctx)->t_send_ns = latency_now_ns();
+        latency_record(LATENCY_STAGE_SEND_QUEUE, t_read_ns, (*ctx)->t_send_ns);
+        latency_chunk_stamps stamps = {
+            .t_read_ns = htobe64(latency_wall_ns(t_read_ns)),
+            .t_send_ns = htobe64(latency_wall_ns((*ctx)->t_send_ns))
+        };
+        start -= sizeof(stamps);
+        memcpy(start + sizeof(header), &stamps, sizeof(stamps));
+    }
+    memcpy(start, &header, sizeof(header));
+    *framed_len = (uint32_t)(payload - start) + length;
+    return start;
+}
+
+static inline void latency_send_complete(latency_send_ctx* ctx, bool canceled) {
+    if (ctx == NULL) {
+        return;
+    }
+    if (!canceled) {
+        latency_record(LATENCY_STAGE_SEND_COMPLETE, ctx->t_send_ns, latency_now_ns());
+    }
+    free(ctx);
+}
+
+// ---- Receiver side ----
+
+typedef void (*latency_deliver_fn)(const uint8_t* buf, uint32_t len);
+
+// Reassembles headers that straddle QUIC receive buffers. Keep one per stream
+// (the stream callback context), zeroed or latency_rx_reset() before first use.
+typedef struct latency_rx {
+    uint8_t header_bytes[LATENCY_HEADER_ROOM];
+    uint32_t header_have;
+    uint32_t header_need;    // 0 until the first header byte of a chunk arrives
+    uint32_t remaining;
+    bool sampled;
+    bool failed;             // Framing lost, the stream must be aborted
+    uint64_t t_read_wall_ns;
+    uint64_t t_recv_ns;
+} latency_rx;
+
+static inline void latency_rx_reset(latency_rx* rx) {
+    memset(rx, 0, sizeof(*rx));
+}
+
+// t_recv_ns is latency_now_ns() at the RECEIVE event. Returns false once the
+// framing is lost; nothing more is delivered from this stream after that.
+static inline bool latency_rx_feed(latency_rx* rx, const uint8_t* buf, uint32_t len, uint64_t t_recv_ns,
+                                   latency_deliver_fn deliver) {
+    while (len > 0 && !rx->failed) {
+        if (rx->remaining == 0) {
+            if (rx->header_need == 0) {
+                rx->header_need = sizeof(latency_chunk_header);
+            }
+            uint32_t need = rx->header_need - rx->header_have;
+            uint32_t n = len < need ? len : need;
+            memcpy(rx->header_bytes + rx->header_have, buf, n);
+            rx->header_have += n;
+            buf += n;
+            len -= n;
+            if (rx->header_have < rx->header_need) {
+                continue;
+            }
+            latency_chunk_header header;
+            memcpy(&header, rx->header_bytes, sizeof(header));
+            if (ntohl(header.magic) != LATENCY_TRACE_MAGIC) {
+                fprintf(stderr, "[TRACE][ERROR] Bad chunk header magic, is the peer built with LATENCY_TRACE?\n");
+                rx->failed = true;
+                break;
+            }
+            uint32_t length = ntohl(header.length);
+            if ((length & LATENCY_CHUNK_SAMPLED) && rx->header_need == sizeof(header)) {
+                rx->header_need = LATENCY_HEADER_ROOM;
+                continue;
+            }
+            rx->sampled = (length & LATENCY_CHUNK_SAMPLED) != 0;
+            rx->remaining = length & ~LATENCY_CHUNK_SAMPLED;
+            rx->header_have = 0;
+            rx->header_need = 0;
+            if (rx->sampled) {
+                latency_chunk_stamps stamps;
+                memcpy(&stamps, rx->header_bytes + sizeof(header), sizeof(stamps));
+                rx->t_read_wall_ns = be64toh(stamps.t_read_ns);
+                rx->t_recv_ns = t_recv_ns;
+                latency_record(LATENCY_STAGE_NETWORK, be64toh(stamps.t_send_ns), latency_wall_ns(t_recv_ns));
+            }
+            continue;
+        }
+        uint32_t n = len < rx->remaining ? len : rx->remaining;
+        deliver(buf, n);
+        buf += n;
+        len -= n;
+        rx->remaining -= n;
+        if (rx->remaining == 0 && rx->sampled) {
+            uint64_t t_done_ns = latency_now_ns();
+            latency_record(LATENCY_STAGE_TCP_WRITE, rx->t_recv_ns, t_done_ns);
+            latency_record(LATENCY_STAGE_END_TO_END, rx->t_read_wall_ns, latency_wall_ns(t_done_ns));
+        }
+    }
+    return !rx->failed;
+}
+
+#endif // LATENCY_TRACE
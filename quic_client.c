@@ -1,4 +1,8 @@
 // Compile with: gcc quicclient.c -o quicclient -lmsquic -lpthread
+// Latency tracing: add -DLATENCY_TRACE=1 (the server must be built the same way)
+// Traffic capture: add -DTRAFFIC_CAPTURE=1 (and -DCAPTURE_PAYLOADS=1 to keep the bytes), replay with quic_replay
+
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,18 +11,75 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <endian.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <msquic.h>
+#include "latency_trace.h"
+#include "traffic_capture.h"
+#include "file_transfer.h"
+#include "cpu_placement.h"
 
 // CONFIG
 #define QUIC_PORT 50072
 #define REMOTE_ADDR "127.0.0.1"
+#define REMOTE_ADDR6 "::1"
 #define BUFFER_SIZE 4096
 #define LOCAL_TCP_PORT 44444
+#define LOCAL_UNIX_PATH ""             // e.g. "/tmp/quic_client.sock" to accept local apps over AF_UNIX instead of TCP
+#define RELAY_FOLLOW_IDEAL_PROCESSOR 0 // 1 = pin the relay thread next to the active connection's msquic worker (see cpu_placement.h)
+
+// Warm connection manager: keepalives stop the tunnel from idling out and a
+// pre-handshaked standby connection is kept parked so that a dropped or
+// rotated active connection never puts a handshake on the request path.
+#define IDLE_TIMEOUT_MS 60000                   // Same as the server's IdleTimeoutMs
+#define KEEPALIVE_INTERVAL_MS 15000             // Well inside the idle timeout
+#define WARM_STANDBY 1                          // 1 = keep one standby connection warm, 0 = off
+#define WARM_CHECK_INTERVAL_MS 1000             // How often the main loop services warm connections
+#define MAX_BYTES_PER_KEY 274877906944ULL       // Same as the server's MaxBytesPerKey
+#define WARM_ROTATE_BYTES (MAX_BYTES_PER_KEY / 10 * 9) // Rotate to the standby after this much traffic
+
+// Connection racing: start_quic_client() races handshakes to every endpoint
+// below, Happy-Eyeballs style. Attempts are launched RACE_STAGGER_MS apart
+// (sooner if the previous ones have already failed), in order of the path
+// RTT msquic measured on earlier connections to each endpoint (handshake
+// time for endpoints that never connected). The first to complete becomes
+// the active connection and the rest are cancelled.
+#define REMOTE_ENDPOINTS { \
+    {.addr = REMOTE_ADDR, .port = QUIC_PORT, .family = QUIC_ADDRESS_FAMILY_INET}, \
+    {.addr = REMOTE_ADDR6, .port = QUIC_PORT, .family = QUIC_ADDRESS_FAMILY_INET6}, \
+}
+#define RACE_STAGGER_MS 250
+
+// Stream pool: every TCP session gets its own stream, taken from a pool of
+// streams already started on the active connection and accepted by the
+// server, so the first bytes go out without a StreamOpen/StreamStart or a
+// wait for stream credit, and the server can relay to the session first.
+#define STREAM_POOL_SIZE 4
+
+// Bulk file transfer: a local app writes "<source path> [dest name]\n" to
+// LOCAL_FILE_PORT and gets "OK <bytes>\n" once the server confirmed the file
+// is written, or "ERR\n". The source is mmap'd and handed to StreamSend in
+// FILE_SEND_REGION slices on a separate connection with send buffering off,
+// so msquic reads the file straight from the page cache. A source that is
+// truncated or modified while it is being sent is reported as ERR (see
+// file_sigbus_handler).
+#define LOCAL_FILE_PORT 44445
+#define FILE_SEND_REGION (64u << 20)   // Bytes per QUIC_BUFFER, a multiple of the page size
+#define MAX_FILE_REQUESTS 8            // Control connections still sending their request line
+#define MAX_FILE_SENDS 16              // Transfers mapped at once
 
 // MSQUIC globals
 const QUIC_API_TABLE* MsQuic;
@@ -30,16 +91,101 @@ HQUIC QuicStream = NULL;
 // Connection state
 bool connection_ready = false;
 
+// Warm standby state
+HQUIC StandbyConnection = NULL;
+bool standby_ready = false;
+int standby_ideal_processor = -1;      // Under race_lock, applied to the relay thread on promotion
+uint64_t active_bytes_sent = 0;
+
+// Connection race state, guarded by race_lock. race_lock also guards every
+// write to Connection and StandbyConnection, whichever thread makes it.
+typedef struct remote_endpoint {
+    const char* addr;
+    uint16_t port;
+    QUIC_ADDRESS_FAMILY family;
+    uint32_t handshake_us;      // Smoothed handshake time, 0 = never connected
+    uint32_t rtt_us;            // Smoothed RTT msquic reported at handshake completion, 0 = unknown
+    bool last_failed;
+    HQUIC attempt;              // In-flight race attempt, if any; closed only by its SHUTDOWN_COMPLETE
+    bool cancelling;            // attempt lost the race and is being shut down
+    uint64_t attempt_start_us;
+} remote_endpoint;
+remote_endpoint remote_endpoints[] = REMOTE_ENDPOINTS;
+#define REMOTE_ENDPOINT_COUNT ((int)(sizeof(remote_endpoints) / sizeof(remote_endpoints[0])))
+pthread_mutex_t race_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t race_cond = PTHREAD_COND_INITIALIZER;
+bool race_in_progress = false;
+bool race_launching = false;
+bool race_won = false;
+
+// Stream pool state. Filled by the main loop and msquic callbacks, so every
+// access goes through stream_pool_lock.
+typedef struct pooled_stream {
+    HQUIC stream;
+    HQUIC connection;
+    bool reserved;              // Being opened by refill_stream_pool(), stream not set yet
+    bool started;
+    bool accepted;              // Peer granted credit: the server has seen the stream
+    uint64_t id;                // Valid once started
+} pooled_stream;
+pooled_stream stream_pool[STREAM_POOL_SIZE];
+pthread_mutex_t stream_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// File transfer state. Kept off Connection: the relay sends from its stack
+// buffer and needs msquic's send buffering, file sends must not be copied.
+typedef struct file_send {
+    int control_fd;             // Local app waiting for the result
+    int fd;                     // Source, kept open to check it did not change
+    struct timespec mtime;
+    uint8_t* map;
+    uint64_t size;
+    int slot;                   // Index in file_sends_mapped, -1 if nothing is mapped
+    bool changed;               // Set by file_sigbus_handler: the source shrank under the mapping
+    struct file_send* next;     // file_sends_waiting
+    file_transfer_header header;
+    char name[FILE_TRANSFER_MAX_NAME + 1];
+    QUIC_BUFFER* buffers;       // Header, name, then the mapped regions
+    uint32_t buffer_count;
+    bool confirmed;             // Server answered FILE_TRANSFER_STATUS_OK
+} file_send;
+HQUIC FileConfiguration = NULL;
+HQUIC FileConnection = NULL;
+bool file_connection_ready = false;
+file_send* file_sends_waiting = NULL;   // Queued until FileConnection's CONNECTED starts them
+// Guards FileConnection, file_connection_ready and file_sends_waiting
+pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+file_send* file_sends_mapped[MAX_FILE_SENDS]; // Read by file_sigbus_handler, hence atomics
+long file_page_size = 4096;
+int file_server = -1;
+
+// Request lines are read from the select loop as they arrive, never blocking it
+typedef struct file_request {
+    int fd;                     // -1 = free slot
+    size_t have;
+    char line[PATH_MAX + FILE_TRANSFER_MAX_NAME + 2];
+} file_request;
+file_request file_requests[MAX_FILE_REQUESTS];
+
 // TCP relay globals
 int tcp_server = -1;
 int tcp_client = -1;
+bool local_is_unix = false;
 
 void close_tcp_client() {
     if (tcp_client != -1) {
+#if TRAFFIC_CAPTURE
+        capture_event(CAPTURE_EVENT_SESSION_CLOSE, capture_session, NULL, 0);
+#endif
         printf("[TCP] Closing local TCP client connection.\n");
         close(tcp_client);
         tcp_client = -1;
     }
+    // The session's stream ends with it; the handle is closed on SHUTDOWN_COMPLETE
+    if (QuicStream != NULL) {
+        printf("[QUIC] Finishing session stream %p.\n", (void*)QuicStream);
+        MsQuic->StreamShutdown(QuicStream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+        QuicStream = NULL;
+    }
 }
 
 int setup_local_tcp_server(uint16_t port) {
@@ -69,36 +215,244 @@ int setup_local_tcp_server(uint16_t port) {
     return sock;
 }
 
+// Same relay semantics as the TCP listener, but same-host peers skip the
+// loopback TCP stack (checksums, segmentation, ACKs, Nagle) entirely.
+int setup_local_unix_server(const char* path) {
+    printf("[UNIX] Creating local AF_UNIX server socket at %s\n", path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("[UNIX][ERROR] socket");
+        exit(1);
+    }
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[UNIX][ERROR] Socket path too long: %s\n", path);
+        close(sock);
+        exit(1);
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path); // Remove a stale socket left by a previous run
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[UNIX][ERROR] bind");
+        close(sock);
+        exit(1);
+    }
+    if (listen(sock, 5) < 0) {
+        perror("[UNIX][ERROR] listen");
+        close(sock);
+        exit(1);
+    }
+    printf("[UNIX] Local AF_UNIX server listening on fd=%d.\n", sock);
+    local_is_unix = true;
+    return sock;
+}
+
+int setup_local_server() {
+    if (LOCAL_UNIX_PATH[0] != '\0') {
+        return setup_local_unix_server(LOCAL_UNIX_PATH);
+    }
+    return setup_local_tcp_server(LOCAL_TCP_PORT);
+}
+
 // Forward declarations
 void msquic_cleanup();
-void start_quic_client(const char* remote_addr, uint16_t port);
+void start_quic_client();
 void ensure_quic_stream();
+bool promote_standby_connection();
+void stream_pool_remove(HQUIC stream);
+QUIC_STATUS QUIC_API ClientStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event);
+
+void relay_to_tcp_client(const uint8_t* buf, uint32_t len) {
+    if (tcp_client != -1) {
+        ssize_t nwritten = write(tcp_client, buf, len);
+        if (nwritten < 0) {
+            perror("[TCP][ERROR] write to tcp_client");
+            close_tcp_client();
+        } else {
+#if TRAFFIC_CAPTURE
+            // Only what the local peer actually got, so a replay never expects dropped bytes
+            capture_event(CAPTURE_EVENT_TCP_WRITE, capture_session, buf, (uint32_t)nwritten);
+#endif
+            printf("[RELAY] Wrote %zd bytes to TCP client.\n", nwritten);
+        }
+    } else {
+        printf("[RELAY][WARN] No TCP client connected, data dropped.\n");
+    }
+}
+
+// ClientStreamCallback context. A stream starts on a chunk boundary, so when
+// tracing each one gets its own deframer; otherwise there is nothing to keep.
+void* new_stream_context() {
+#if LATENCY_TRACE
+    latency_rx* rx = calloc(1, sizeof(*rx));
+    if (rx == NULL) {
+        fprintf(stderr, "[TRACE][ERROR] Out of memory for stream deframer\n");
+        exit(1);
+    }
+    return rx;
+#else
+    return NULL;
+#endif
+}
+
+// Streams are started with QUIC_STREAM_START_FLAG_IMMEDIATE, so the server
+// sees each one before any session uses it and can point its relay at the
+// next one (the lowest ID, see take_pooled_stream) before the client sends.
+// Runs on the main thread and on msquic workers: the slot is reserved under
+// stream_pool_lock, and race_lock is held while Connection is used so
+// SHUTDOWN_COMPLETE cannot close it underneath us. stream_pool_lock itself is
+// not held across StreamStart, which may deliver START_COMPLETE inline.
+void refill_stream_pool() {
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        pthread_mutex_lock(&race_lock);
+        HQUIC connection = connection_ready ? Connection : NULL;
+        if (connection == NULL) {
+            pthread_mutex_unlock(&race_lock);
+            return;
+        }
+        pthread_mutex_lock(&stream_pool_lock);
+        bool free_slot = stream_pool[i].stream == NULL && !stream_pool[i].reserved;
+        if (free_slot) {
+            stream_pool[i] = (pooled_stream){.reserved = true, .connection = connection};
+        }
+        pthread_mutex_unlock(&stream_pool_lock);
+        if (!free_slot) {
+            pthread_mutex_unlock(&race_lock);
+            continue;
+        }
+        HQUIC stream = NULL;
+        void* context = new_stream_context();
+        QUIC_STATUS status = MsQuic->StreamOpen(connection, QUIC_STREAM_OPEN_FLAG_NONE, ClientStreamCallback, context, &stream);
+        if (QUIC_SUCCEEDED(status)) {
+            pthread_mutex_lock(&stream_pool_lock);
+            stream_pool[i].stream = stream;
+            stream_pool[i].reserved = false;
+            pthread_mutex_unlock(&stream_pool_lock);
+            status = MsQuic->StreamStart(stream, QUIC_STREAM_START_FLAG_IMMEDIATE);
+            if (QUIC_FAILED(status)) {
+                fprintf(stderr, "[POOL][ERROR] StreamStart failed with status: 0x%x\n", status);
+                stream_pool_remove(stream);
+                MsQuic->StreamClose(stream);
+            }
+        } else {
+            fprintf(stderr, "[POOL][ERROR] StreamOpen failed with status: 0x%x\n", status);
+            pthread_mutex_lock(&stream_pool_lock);
+            stream_pool[i].reserved = false;
+            pthread_mutex_unlock(&stream_pool_lock);
+        }
+        pthread_mutex_unlock(&race_lock);
+        if (QUIC_FAILED(status)) {
+            free(context);
+            return;
+        }
+    }
+}
+
+void stream_pool_mark_started(HQUIC stream, QUIC_STATUS status, uint64_t id, bool peer_accepted) {
+    pthread_mutex_lock(&stream_pool_lock);
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        if (stream_pool[i].stream == stream) {
+            if (QUIC_FAILED(status)) {
+                fprintf(stderr, "[POOL][ERROR] Pooled stream start failed: 0x%x\n", status);
+            } else {
+                stream_pool[i].started = true;
+                stream_pool[i].accepted = peer_accepted;
+                stream_pool[i].id = id;
+                printf("[POOL] Stream %p (id %llu) started in slot %d%s.\n", (void*)stream, (unsigned long long)id, i,
+                       peer_accepted ? "" : ", waiting for stream credit");
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream_pool_lock);
+}
+
+void stream_pool_mark_accepted(HQUIC stream) {
+    pthread_mutex_lock(&stream_pool_lock);
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        if (stream_pool[i].stream == stream) {
+            stream_pool[i].accepted = true;
+            printf("[POOL] Stream %p (id %llu) accepted by the server.\n", (void*)stream,
+                   (unsigned long long)stream_pool[i].id);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream_pool_lock);
+}
+
+void stream_pool_remove(HQUIC stream) {
+    pthread_mutex_lock(&stream_pool_lock);
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        if (stream_pool[i].stream == stream) {
+            stream_pool[i].stream = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream_pool_lock);
+}
+
+// Hands out the lowest stream ID first, and only streams the server has
+// accepted. The server relies on this order: it points its relay at the
+// lowest unfinished stream before the session sends anything.
+HQUIC take_pooled_stream() {
+    HQUIC stream = NULL;
+    int best = -1;
+    pthread_mutex_lock(&stream_pool_lock);
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        if (stream_pool[i].stream != NULL && stream_pool[i].started && stream_pool[i].accepted &&
+            stream_pool[i].connection == Connection &&
+            (best == -1 || stream_pool[i].id < stream_pool[best].id)) {
+            best = i;
+        }
+    }
+    if (best != -1) {
+        stream = stream_pool[best].stream;
+        stream_pool[best].stream = NULL;
+    }
+    pthread_mutex_unlock(&stream_pool_lock);
+    return stream;
+}
 
 QUIC_STATUS QUIC_API ClientStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event) {
     switch (Event->Type) {
         case QUIC_STREAM_EVENT_RECEIVE:
             printf("[QUIC] Received %llu bytes from remote peer. Relaying to TCP client...\n",
                    (unsigned long long)Event->RECEIVE.TotalBufferLength);
+#if LATENCY_TRACE
+            uint64_t t_recv = latency_now_ns();
+#endif
             for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
-                if (tcp_client != -1) {
-                    ssize_t nwritten = write(tcp_client,
-                        Event->RECEIVE.Buffers[i].Buffer,
-                        Event->RECEIVE.Buffers[i].Length);
-                    if (nwritten < 0) {
-                        perror("[TCP][ERROR] write to tcp_client");
-                        close_tcp_client();
-                    } else {
-                        printf("[RELAY] Wrote %zd bytes to TCP client.\n", nwritten);
-                    }
-                } else {
-                    printf("[RELAY][WARN] No TCP client connected, data dropped.\n");
+#if LATENCY_TRACE
+                if (!latency_rx_feed(Context, Event->RECEIVE.Buffers[i].Buffer, Event->RECEIVE.Buffers[i].Length,
+                                     t_recv, relay_to_tcp_client)) {
+                    // Misparsed bytes would corrupt the session - drop the stream instead
+                    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, LATENCY_TRACE_ERROR_FRAMING);
+                    break;
                 }
+#else
+                relay_to_tcp_client(Event->RECEIVE.Buffers[i].Buffer, Event->RECEIVE.Buffers[i].Length);
+#endif
             }
             MsQuic->StreamReceiveComplete(Stream, Event->RECEIVE.TotalBufferLength);
             break;
+#if LATENCY_TRACE
+        case QUIC_STREAM_EVENT_SEND_COMPLETE:
+            latency_send_complete(Event->SEND_COMPLETE.ClientContext, Event->SEND_COMPLETE.Canceled);
+            break;
+#endif
+        case QUIC_STREAM_EVENT_START_COMPLETE:
+            stream_pool_mark_started(Stream, Event->START_COMPLETE.Status, Event->START_COMPLETE.ID,
+                                     Event->START_COMPLETE.PeerAccepted);
+            break;
+        case QUIC_STREAM_EVENT_PEER_ACCEPTED:
+            stream_pool_mark_accepted(Stream);
+            break;
         case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
             printf("[QUIC] Stream shutdown complete. Closing stream handle.\n");
+            stream_pool_remove(Stream);
             MsQuic->StreamClose(Stream);
+            free(Context);
             if (Stream == QuicStream) {
                 QuicStream = NULL;
             }
@@ -110,23 +464,165 @@ QUIC_STATUS QUIC_API ClientStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
     return QUIC_STATUS_SUCCESS;
 }
 
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int race_attempts_in_flight() {
+    int count = 0;
+    for (int i = 0; i < REMOTE_ENDPOINT_COUNT; ++i) {
+        if (remote_endpoints[i].attempt != NULL) count++;
+    }
+    return count;
+}
+
+// Called under race_lock once nothing is left to launch or in flight.
+void race_finish_if_lost() {
+    if (!race_won && !race_launching && race_attempts_in_flight() == 0) {
+        printf("[RACE] All %d endpoints failed.\n", REMOTE_ENDPOINT_COUNT);
+        race_in_progress = false;
+        pthread_cond_broadcast(&race_cond);
+    }
+}
+
+// First attempt to finish its handshake becomes the active connection.
+// Losers stay registered in ep->attempt, marked cancelling, and are shut
+// down under race_lock: ConnectionShutdown only queues the shutdown, and a
+// loser's handle cannot be closed before its SHUTDOWN_COMPLETE takes the
+// lock and unregisters it, so no loser is ever shut down after being freed.
+bool race_claim_win(HQUIC handle, remote_endpoint* ep) {
+    int loser_count = 0;
+    // Called on handle's own worker, so GetParam runs inline
+    QUIC_STATISTICS_V2 stats = {0};
+    uint32_t stats_size = sizeof(stats);
+    if (QUIC_FAILED(MsQuic->GetParam(handle, QUIC_PARAM_CONN_STATISTICS_V2, &stats_size, &stats))) {
+        stats.Rtt = 0;
+    }
+    pthread_mutex_lock(&race_lock);
+    uint32_t sample = (uint32_t)(monotonic_us() - ep->attempt_start_us);
+    ep->handshake_us = ep->handshake_us ? (ep->handshake_us * 3 + sample) / 4 : sample;
+    if (stats.Rtt > 0) {
+        ep->rtt_us = ep->rtt_us ? (ep->rtt_us * 3 + stats.Rtt) / 4 : stats.Rtt;
+    }
+    ep->last_failed = false;
+    if (race_won) {
+        pthread_mutex_unlock(&race_lock);
+        printf("[RACE] %s:%d connected after the race was decided (%u us, RTT %u us), closing it.\n",
+               ep->addr, ep->port, sample, stats.Rtt);
+        return false;
+    }
+    ep->attempt = NULL;
+    // A standby may have been promoted while the race was running
+    bool superseded = Connection != NULL;
+    race_won = true;
+    race_in_progress = false;
+    if (!superseded) {
+        Connection = handle;
+        active_bytes_sent = 0;
+    }
+    for (int i = 0; i < REMOTE_ENDPOINT_COUNT; ++i) {
+        if (remote_endpoints[i].attempt != NULL && !remote_endpoints[i].cancelling) {
+            remote_endpoints[i].cancelling = true;
+            MsQuic->ConnectionShutdown(remote_endpoints[i].attempt, QUIC_CONNECTION_SHUTDOWN_FLAG_SILENT, 0);
+            loser_count++;
+        }
+    }
+    pthread_cond_broadcast(&race_cond);
+    pthread_mutex_unlock(&race_lock);
+
+    if (superseded) {
+        printf("[RACE] Standby connection was promoted meanwhile, closing %s:%d.\n", ep->addr, ep->port);
+        return false;
+    }
+    printf("[RACE] %s:%d won the race (handshake %u us, RTT %u us), cancelled %d other attempts.\n",
+           ep->addr, ep->port, sample, stats.Rtt, loser_count);
+    return true;
+}
+
+void race_attempt_failed(HQUIC handle, remote_endpoint* ep) {
+    pthread_mutex_lock(&race_lock);
+    if (ep->attempt == handle) {
+        ep->attempt = NULL;
+        if (ep->cancelling) {
+            printf("[RACE] Cancelled attempt to %s:%d shut down.\n", ep->addr, ep->port);
+        } else {
+            printf("[RACE] Attempt to %s:%d failed.\n", ep->addr, ep->port);
+            ep->last_failed = true;
+        }
+        ep->cancelling = false;
+        pthread_cond_broadcast(&race_cond);
+        race_finish_if_lost();
+    }
+    pthread_mutex_unlock(&race_lock);
+}
+
 QUIC_STATUS QUIC_API ClientConnectionCallback(HQUIC ConnectionHandle, void* Context, QUIC_CONNECTION_EVENT* Event) {
     printf("[QUIC] Connection event type: %d\n", Event->Type);
     switch (Event->Type) {
         case QUIC_CONNECTION_EVENT_CONNECTED:
+            if (ConnectionHandle == StandbyConnection) {
+                printf("[WARM] Standby connection handshake complete, parked for reuse.\n");
+                standby_ready = true;
+                break;
+            }
+            if (Context != NULL && !race_claim_win(ConnectionHandle, Context)) {
+                MsQuic->ConnectionShutdown(ConnectionHandle, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+                break;
+            }
             printf("[QUIC] Connected to server! Connection is stable and ready.\n");
             connection_ready = true;
             // Give the server a moment to be ready for streams
             printf("[QUIC] Waiting 200ms for server to be ready for streams...\n");
             usleep(200000); // 200ms delay
             ensure_quic_stream();
+            refill_stream_pool();
             break;
-        case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
-            printf("[QUIC] Connection shutdown complete. Will reconnect on next request.\n");
+        case QUIC_CONNECTION_EVENT_STREAMS_AVAILABLE:
+            printf("[POOL] Server granted stream credit: %u bidi streams available.\n",
+                   Event->STREAMS_AVAILABLE.BidirectionalCount);
+            if (ConnectionHandle == Connection) {
+                refill_stream_pool();
+            }
+            break;
+        case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE: {
+            // Closed only after race_lock is released: the main thread shuts
+            // connections down under it and must never see a freed handle
+            bool owned = true;
+            pthread_mutex_lock(&race_lock);
+            if (ConnectionHandle == StandbyConnection) {
+                printf("[WARM] Standby connection shutdown complete. Will re-warm on next check.\n");
+                StandbyConnection = NULL;
+                standby_ready = false;
+            } else if (ConnectionHandle == Connection) {
+                printf("[QUIC] Connection shutdown complete. Will reconnect on next request.\n");
+                Connection = NULL;
+                QuicStream = NULL;
+                connection_ready = false;
+            } else {
+                owned = false;
+            }
+            pthread_mutex_unlock(&race_lock);
+            if (!owned && Context != NULL) {
+                race_attempt_failed(ConnectionHandle, Context);
+            } else if (!owned) {
+                printf("[WARM] Retired connection shutdown complete.\n");
+            }
             MsQuic->ConnectionClose(ConnectionHandle);
-            Connection = NULL;
-            QuicStream = NULL;
-            connection_ready = false;
+            break;
+        }
+        case QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED:
+            printf("[QUIC] Ideal processor changed: processor=%u.\n", Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor);
+#if RELAY_FOLLOW_IDEAL_PROCESSOR
+            pthread_mutex_lock(&race_lock);
+            if (ConnectionHandle == Connection) {
+                relay_placement_request(Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor);
+            } else if (ConnectionHandle == StandbyConnection) {
+                standby_ideal_processor = Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor;
+            }
+            pthread_mutex_unlock(&race_lock);
+#endif
             break;
         default:
             printf("[QUIC] Unhandled connection event type: %d\n", Event->Type);
@@ -150,6 +646,10 @@ void msquic_init() {
     }
 
     QUIC_SETTINGS Settings = {0};
+    Settings.IdleTimeoutMs = IDLE_TIMEOUT_MS;
+    Settings.KeepAliveIntervalMs = KEEPALIVE_INTERVAL_MS;
+    Settings.IsSet.IdleTimeoutMs = TRUE;
+    Settings.IsSet.KeepAliveIntervalMs = TRUE;
 
     printf("[QUIC] Opening configuration context...\n");
     if (QUIC_FAILED(MsQuic->ConfigurationOpen(
@@ -172,6 +672,17 @@ void msquic_init() {
         printf("[QUIC][ERROR] ConfigurationLoadCredential failed!\n");
         exit(1);
     }
+
+    // File transfers: own ALPN so the server routes them away from the relay,
+    // and msquic sends straight out of the mapped file
+    QUIC_BUFFER file_alpn = {sizeof(FILE_TRANSFER_ALPN) - 1, (uint8_t*)FILE_TRANSFER_ALPN};
+    Settings.SendBufferingEnabled = FALSE;
+    Settings.IsSet.SendBufferingEnabled = TRUE;
+    if (QUIC_FAILED(MsQuic->ConfigurationOpen(Registration, &file_alpn, 1, &Settings, sizeof(Settings), NULL, &FileConfiguration)) ||
+        QUIC_FAILED(MsQuic->ConfigurationLoadCredential(FileConfiguration, &CredConfig))) {
+        fprintf(stderr, "[FILE][ERROR] File transfer configuration failed\n");
+        exit(1);
+    }
     printf("[QUIC] msquic API and credentials loaded successfully.\n");
 }
 
@@ -179,38 +690,203 @@ void msquic_cleanup() {
     printf("[CLEANUP] Cleaning up msquic resources...\n");
     if (QuicStream) MsQuic->StreamClose(QuicStream);
     if (Connection) MsQuic->ConnectionClose(Connection);
+    if (StandbyConnection) MsQuic->ConnectionClose(StandbyConnection);
+    if (FileConnection) MsQuic->ConnectionClose(FileConnection);
     if (Configuration) MsQuic->ConfigurationClose(Configuration);
+    if (FileConfiguration) MsQuic->ConfigurationClose(FileConfiguration);
     if (Registration) MsQuic->RegistrationClose(Registration);
     if (MsQuic) MsQuicClose(MsQuic);
     printf("[CLEANUP] Done cleaning up msquic resources.\n");
 }
 
-void start_quic_client(const char* remote_addr, uint16_t port) {
-    if (Connection != NULL) {
-        printf("[QUIC] Connection already exists or starting, skipping new ConnectionOpen.\n");
-        return;
-    }
-    printf("[QUIC] Opening client connection context...\n");
-    if (QUIC_FAILED(MsQuic->ConnectionOpen(Registration, ClientConnectionCallback, NULL, &Connection))) {
+bool open_quic_connection(HQUIC* handle, remote_endpoint* ep, void* context) {
+    if (QUIC_FAILED(MsQuic->ConnectionOpen(Registration, ClientConnectionCallback, context, handle))) {
         fprintf(stderr, "[QUIC][ERROR] ConnectionOpen failed\n");
-        Connection = NULL;
-        return;
+        *handle = NULL;
+        return false;
     }
-    printf("[QUIC] Starting connection to %s:%d...\n", remote_addr, port);
-    QUIC_STATUS status = MsQuic->ConnectionStart(Connection, Configuration, QUIC_ADDRESS_FAMILY_UNSPEC, remote_addr, port);
+    printf("[QUIC] Starting connection to %s:%d...\n", ep->addr, ep->port);
+    QUIC_STATUS status = MsQuic->ConnectionStart(*handle, Configuration, ep->family, ep->addr, ep->port);
     if (QUIC_FAILED(status)) {
         fprintf(stderr, "[QUIC][ERROR] ConnectionStart failed: 0x%x\n", status);
-        MsQuic->ConnectionClose(Connection);
-        Connection = NULL;
+        MsQuic->ConnectionClose(*handle);
+        *handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Known-good endpoints by RTT (handshake time if msquic reported none), then
+// untried ones, then last failures.
+void race_order(int* order) {
+    uint32_t keys[REMOTE_ENDPOINT_COUNT];
+    for (int i = 0; i < REMOTE_ENDPOINT_COUNT; ++i) {
+        remote_endpoint* ep = &remote_endpoints[i];
+        uint32_t known = ep->rtt_us ? ep->rtt_us : ep->handshake_us;
+        keys[i] = ep->last_failed ? UINT32_MAX : (known ? known : UINT32_MAX - 1);
+        int j = i;
+        while (j > 0 && keys[order[j - 1]] > keys[i]) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+}
+
+void* race_thread(void* arg) {
+    int order[REMOTE_ENDPOINT_COUNT];
+    pthread_mutex_lock(&race_lock);
+    race_order(order);
+    pthread_mutex_unlock(&race_lock);
+
+    for (int k = 0; k < REMOTE_ENDPOINT_COUNT; ++k) {
+        remote_endpoint* ep = &remote_endpoints[order[k]];
+        pthread_mutex_lock(&race_lock);
+        if (race_won) {
+            pthread_mutex_unlock(&race_lock);
+            break;
+        }
+        if (ep->attempt != NULL) {
+            // A loser of the previous race still shutting down; it closes itself
+            printf("[RACE] Skipping %s:%d, its previous attempt is still shutting down.\n", ep->addr, ep->port);
+            pthread_mutex_unlock(&race_lock);
+            continue;
+        }
+        printf("[RACE] Launching attempt %d/%d to %s:%d (RTT history: %u us, handshake: %u us%s).\n",
+               k + 1, REMOTE_ENDPOINT_COUNT, ep->addr, ep->port, ep->rtt_us, ep->handshake_us,
+               ep->last_failed ? ", failed last time" : "");
+        ep->cancelling = false;
+        // Opened under race_lock so neither a quick failure nor a win can slip past ep->attempt
+        ep->attempt_start_us = monotonic_us();
+        if (!open_quic_connection(&ep->attempt, ep, ep)) {
+            ep->last_failed = true;
+        }
+        // Next attempt after the stagger, or right away once everything in flight has failed
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)RACE_STAGGER_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!race_won && race_attempts_in_flight() > 0 &&
+               pthread_cond_timedwait(&race_cond, &race_lock, &deadline) == 0) {
+        }
+        pthread_mutex_unlock(&race_lock);
+    }
+
+    pthread_mutex_lock(&race_lock);
+    race_launching = false;
+    race_finish_if_lost();
+    pthread_mutex_unlock(&race_lock);
+    return NULL;
+}
+
+void start_quic_client() {
+    pthread_mutex_lock(&race_lock);
+    if (Connection != NULL || race_in_progress) {
+        pthread_mutex_unlock(&race_lock);
+        printf("[QUIC] Connection already exists or starting, skipping new ConnectionOpen.\n");
         return;
     }
+    race_in_progress = true;
+    race_launching = true;
+    race_won = false;
+    pthread_mutex_unlock(&race_lock);
+
+    printf("[QUIC] Racing client connections to %d endpoints...\n", REMOTE_ENDPOINT_COUNT);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, race_thread, NULL) != 0) {
+        perror("[RACE][ERROR] pthread_create");
+        pthread_mutex_lock(&race_lock);
+        race_in_progress = false;
+        race_launching = false;
+        pthread_mutex_unlock(&race_lock);
+        return;
+    }
+    pthread_detach(thread);
     printf("[QUIC] Connection initiated. Waiting for handshake...\n");
 }
 
+// Standby connections skip the race and go straight to the fastest known endpoint.
+void start_standby_connection() {
+    if (StandbyConnection != NULL) {
+        return;
+    }
+    int order[REMOTE_ENDPOINT_COUNT];
+    printf("[WARM] Opening standby connection...\n");
+    pthread_mutex_lock(&race_lock);
+    race_order(order);
+    standby_ready = false;
+    standby_ideal_processor = -1;
+    bool opened = open_quic_connection(&StandbyConnection, &remote_endpoints[order[0]], NULL);
+    pthread_mutex_unlock(&race_lock);
+    if (opened) {
+        printf("[WARM] Standby connection initiated. Waiting for handshake...\n");
+    }
+}
+
+// Called under race_lock. Returns the connection the standby replaced, if any.
+bool promote_standby_locked(HQUIC* retired) {
+    *retired = Connection;
+    if (StandbyConnection == NULL || !standby_ready) {
+        return false;
+    }
+    printf("[WARM] Promoting standby connection to active (no handshake needed).\n");
+    Connection = StandbyConnection;
+    StandbyConnection = NULL;
+    standby_ready = false;
+#if RELAY_FOLLOW_IDEAL_PROCESSOR
+    if (standby_ideal_processor >= 0) {
+        relay_placement_request(standby_ideal_processor);
+    }
+#endif
+    standby_ideal_processor = -1;
+    QuicStream = NULL;
+    active_bytes_sent = 0;
+    connection_ready = true;
+    return true;
+}
+
+bool promote_standby_connection() {
+    HQUIC retired;
+    pthread_mutex_lock(&race_lock);
+    bool promoted = (Connection == NULL) && promote_standby_locked(&retired);
+    pthread_mutex_unlock(&race_lock);
+    return promoted;
+}
+
+// Called from the main loop every WARM_CHECK_INTERVAL_MS. Re-establishes a
+// dropped active connection in the background, keeps the standby warm and
+// rotates to it between TCP sessions once the active has carried
+// WARM_ROTATE_BYTES.
+void warm_connection_tick() {
+    if (Connection == NULL && !promote_standby_connection()) {
+        printf("[WARM] No active connection, reconnecting in the background...\n");
+        start_quic_client();
+    }
+    refill_stream_pool();
+#if WARM_STANDBY
+    start_standby_connection();
+    if (connection_ready && active_bytes_sent >= WARM_ROTATE_BYTES && tcp_client == -1 && standby_ready) {
+        printf("[WARM] Active connection carried %llu bytes, rotating to standby.\n",
+               (unsigned long long)active_bytes_sent);
+        // Shut down under race_lock so the retired handle cannot be closed underneath us
+        HQUIC retired = NULL;
+        pthread_mutex_lock(&race_lock);
+        if (promote_standby_locked(&retired) && retired != NULL) {
+            MsQuic->ConnectionShutdown(retired, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+        }
+        pthread_mutex_unlock(&race_lock);
+    }
+#endif
+}
+
 void ensure_quic_stream() {
+    if (Connection == NULL && promote_standby_connection()) {
+        printf("[WARM] Using promoted standby connection for stream.\n");
+    }
     if (Connection == NULL) {
         printf("[QUIC] No QUIC connection, attempting to start one...\n");
-        start_quic_client(REMOTE_ADDR, QUIC_PORT);
+        start_quic_client();
         for(int i=0; i<10 && !connection_ready; ++i) {
             usleep(100000); // Wait up to 1 second
         }
@@ -225,18 +901,32 @@ void ensure_quic_stream() {
         return;
     }
 
+    if (QuicStream == NULL && (QuicStream = take_pooled_stream()) != NULL) {
+        printf("[POOL] Using pre-started stream %p for this session.\n", (void*)QuicStream);
+        refill_stream_pool();
+        return;
+    }
+
     if (QuicStream == NULL) {
         printf("[QUIC] Creating new stream...\n");
-        QUIC_STATUS status = MsQuic->StreamOpen(Connection, QUIC_STREAM_OPEN_FLAG_NONE, ClientStreamCallback, NULL, &QuicStream);
-        if (QUIC_FAILED(status)) {
+        void* context = new_stream_context();
+        // Under race_lock so SHUTDOWN_COMPLETE cannot close Connection meanwhile
+        pthread_mutex_lock(&race_lock);
+        QUIC_STATUS status = Connection != NULL
+            ? MsQuic->StreamOpen(Connection, QUIC_STREAM_OPEN_FLAG_NONE, ClientStreamCallback, context, &QuicStream)
+            : QUIC_STATUS_ABORTED;
+        if (QUIC_SUCCEEDED(status)) {
+            status = MsQuic->StreamStart(QuicStream, QUIC_STREAM_START_FLAG_IMMEDIATE);
+            if (QUIC_FAILED(status)) {
+                fprintf(stderr, "[QUIC][ERROR] StreamStart failed with status: 0x%x\n", status);
+                MsQuic->StreamClose(QuicStream);
+            }
+        } else {
             fprintf(stderr, "[QUIC][ERROR] StreamOpen failed with status: 0x%x\n", status);
-            QuicStream = NULL;
-            return;
         }
-        status = MsQuic->StreamStart(QuicStream, QUIC_STREAM_START_FLAG_IMMEDIATE);
+        pthread_mutex_unlock(&race_lock);
         if (QUIC_FAILED(status)) {
-            fprintf(stderr, "[QUIC][ERROR] StreamStart failed with status: 0x%x\n", status);
-            MsQuic->StreamClose(QuicStream);
+            free(context);
             QuicStream = NULL;
             return;
         }
@@ -244,31 +934,431 @@ void ensure_quic_stream() {
     }
 }
 
+void file_send_finish(file_send* send);
+void file_send_begin(file_send* send);
+
+// Fails every send still waiting for a file connection.
+void file_sends_fail(file_send* list) {
+    while (list != NULL) {
+        file_send* next = list->next;
+        file_send_finish(list);
+        list = next;
+    }
+}
+
+QUIC_STATUS QUIC_API FileConnectionCallback(HQUIC ConnectionHandle, void* Context, QUIC_CONNECTION_EVENT* Event) {
+    switch (Event->Type) {
+        case QUIC_CONNECTION_EVENT_CONNECTED: {
+            printf("[FILE] File transfer connection ready.\n");
+            pthread_mutex_lock(&file_lock);
+            file_connection_ready = true;
+            file_send* waiting = file_sends_waiting;
+            file_sends_waiting = NULL;
+            while (waiting != NULL) {
+                file_send* next = waiting->next;
+                file_send_begin(waiting);
+                waiting = next;
+            }
+            pthread_mutex_unlock(&file_lock);
+            break;
+        }
+        case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE: {
+            printf("[FILE] File transfer connection shutdown complete.\n");
+            file_send* waiting = NULL;
+            pthread_mutex_lock(&file_lock);
+            if (ConnectionHandle == FileConnection) {
+                FileConnection = NULL;
+                file_connection_ready = false;
+                waiting = file_sends_waiting;
+                file_sends_waiting = NULL;
+            }
+            pthread_mutex_unlock(&file_lock);
+            file_sends_fail(waiting);
+            MsQuic->ConnectionClose(ConnectionHandle);
+            break;
+        }
+        default:
+            break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+// Opened on first use to the fastest known endpoint, then reused until it
+// idles out. Never waits for the handshake: sends queued meanwhile are
+// started from CONNECTED. Called with file_lock held.
+bool start_file_connection_locked() {
+    int order[REMOTE_ENDPOINT_COUNT];
+    pthread_mutex_lock(&race_lock);
+    race_order(order);
+    pthread_mutex_unlock(&race_lock);
+    remote_endpoint* ep = &remote_endpoints[order[0]];
+    file_connection_ready = false;
+    if (QUIC_FAILED(MsQuic->ConnectionOpen(Registration, FileConnectionCallback, NULL, &FileConnection))) {
+        fprintf(stderr, "[FILE][ERROR] ConnectionOpen failed\n");
+        FileConnection = NULL;
+        return false;
+    }
+    printf("[FILE] Starting file transfer connection to %s:%d...\n", ep->addr, ep->port);
+    QUIC_STATUS status = MsQuic->ConnectionStart(FileConnection, FileConfiguration, ep->family, ep->addr, ep->port);
+    if (QUIC_FAILED(status)) {
+        fprintf(stderr, "[FILE][ERROR] ConnectionStart failed: 0x%x\n", status);
+        MsQuic->ConnectionClose(FileConnection);
+        FileConnection = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Starts send on the file connection, or queues it until the connection is up.
+void file_send_submit(file_send* send) {
+    file_send* failed = NULL;
+    pthread_mutex_lock(&file_lock);
+    if (file_connection_ready) {
+        file_send_begin(send);
+    } else {
+        send->next = file_sends_waiting;
+        file_sends_waiting = send;
+        if (FileConnection == NULL && !start_file_connection_locked()) {
+            failed = file_sends_waiting;
+            file_sends_waiting = NULL;
+        }
+    }
+    pthread_mutex_unlock(&file_lock);
+    file_sends_fail(failed);
+}
+
+// **msquic READS THE MAPPING ON ITS WORKERS - A SOURCE TRUNCATED DURING A SEND MUST NOT KILL US**
+// The faulting page of a mapped source is replaced with zeros so the read
+// completes, and the send is flagged so file_send_finish reports ERR
+// whatever the server answered. Any other SIGBUS gets the default action.
+void file_sigbus_handler(int sig, siginfo_t* info, void* ucontext) {
+    (void)ucontext;
+    uint8_t* addr = info->si_addr;
+    for (int i = 0; i < MAX_FILE_SENDS; ++i) {
+        file_send* send = __atomic_load_n(&file_sends_mapped[i], __ATOMIC_ACQUIRE);
+        if (send != NULL && addr >= send->map && addr < send->map + send->size) {
+            void* page = (void*)((uintptr_t)addr & ~(uintptr_t)(file_page_size - 1));
+            if (mmap(page, file_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+                __atomic_store_n(&send->changed, true, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+    }
+    signal(sig, SIG_DFL);
+}
+
+void install_file_sigbus_handler() {
+    file_page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction sa = {0};
+    sa.sa_sigaction = file_sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+// Truncated under the mapping, or rewritten in place (size or mtime moved).
+bool file_send_source_changed(file_send* send) {
+    struct stat st;
+    return __atomic_load_n(&send->changed, __ATOMIC_RELAXED) || fstat(send->fd, &st) < 0 ||
+           (uint64_t)st.st_size != send->size || st.st_mtim.tv_sec != send->mtime.tv_sec ||
+           st.st_mtim.tv_nsec != send->mtime.tv_nsec;
+}
+
+// Unregisters and unmaps the source; frees send.
+void file_send_release(file_send* send) {
+    if (send->slot != -1) __atomic_store_n(&file_sends_mapped[send->slot], NULL, __ATOMIC_RELEASE);
+    if (send->map != NULL) munmap(send->map, send->size);
+    close(send->fd);
+    free(send->buffers);
+    free(send);
+}
+
+// Reports the result to the local app and releases the mapping.
+void file_send_finish(file_send* send) {
+    if (send->confirmed && file_send_source_changed(send)) {
+        printf("[FILE][ERROR] %s: source changed while it was sent.\n", send->name);
+        dprintf(send->control_fd, "ERR\n");
+    } else if (send->confirmed) {
+        printf("[FILE] %s: %llu bytes delivered.\n", send->name, (unsigned long long)send->size);
+        dprintf(send->control_fd, "OK %llu\n", (unsigned long long)send->size);
+    } else {
+        printf("[FILE][ERROR] %s: transfer failed.\n", send->name);
+        dprintf(send->control_fd, "ERR\n");
+    }
+    close(send->control_fd);
+    file_send_release(send);
+}
+
+QUIC_STATUS QUIC_API FileStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event) {
+    file_send* send = Context;
+    switch (Event->Type) {
+        case QUIC_STREAM_EVENT_RECEIVE:
+            // **THE ONLY THING THE SERVER SENDS IS ITS ONE-BYTE STATUS**
+            if (Event->RECEIVE.AbsoluteOffset == 0 && Event->RECEIVE.BufferCount > 0 &&
+                Event->RECEIVE.Buffers[0].Length > 0) {
+                send->confirmed = Event->RECEIVE.Buffers[0].Buffer[0] == FILE_TRANSFER_STATUS_OK;
+            }
+            break;
+        case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+            printf("[FILE][ERROR] Server rejected %s (error %llu).\n", send->name,
+                   (unsigned long long)Event->PEER_SEND_ABORTED.ErrorCode);
+            send->confirmed = false;
+            break;
+        case QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED:
+            printf("[FILE][ERROR] Server stopped receiving %s (error %llu).\n", send->name,
+                   (unsigned long long)Event->PEER_RECEIVE_ABORTED.ErrorCode);
+            send->confirmed = false;
+            break;
+        case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+            MsQuic->StreamClose(Stream);
+            file_send_finish(send);
+            break;
+        default:
+            break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+// Opens the stream and queues the file as a single StreamSend with FIN.
+// Called with file_lock held once FileConnection is up; any failure is
+// reported to the local app through file_send_finish.
+void file_send_begin(file_send* send) {
+    HQUIC stream = NULL;
+    QUIC_STATUS status = MsQuic->StreamOpen(FileConnection, QUIC_STREAM_OPEN_FLAG_NONE, FileStreamCallback, send, &stream);
+    if (QUIC_SUCCEEDED(status)) {
+        status = MsQuic->StreamStart(stream, QUIC_STREAM_START_FLAG_NONE);
+        if (QUIC_FAILED(status)) {
+            MsQuic->StreamClose(stream);
+        }
+    }
+    if (QUIC_FAILED(status)) {
+        fprintf(stderr, "[FILE][ERROR] Could not open a file transfer stream: 0x%x\n", status);
+        file_send_finish(send);
+        return;
+    }
+    // From here on the stream owns send: SHUTDOWN_COMPLETE reports and frees it
+    status = MsQuic->StreamSend(stream, send->buffers, send->buffer_count, QUIC_SEND_FLAG_FIN, send);
+    if (QUIC_FAILED(status)) {
+        fprintf(stderr, "[FILE][ERROR] StreamSend failed (status=0x%x)\n", status);
+        MsQuic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+        return;
+    }
+    printf("[FILE] Sending %s (%llu bytes in %u regions).\n", send->name,
+           (unsigned long long)send->size, send->buffer_count - 2);
+}
+
+// Maps the file and hands it to file_send_submit. Returns false (and leaves
+// control_fd to the caller) if nothing was queued.
+bool start_file_send(int control_fd, const char* path, const char* name) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > FILE_TRANSFER_MAX_NAME || strchr(name, '/') != NULL) {
+        fprintf(stderr, "[FILE][ERROR] Bad destination name '%s'\n", name);
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("[FILE][ERROR] open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "[FILE][ERROR] %s is not a regular file\n", path);
+        close(fd);
+        return false;
+    }
+    file_send* send = calloc(1, sizeof(*send));
+    if (send == NULL) {
+        close(fd);
+        return false;
+    }
+    send->control_fd = control_fd;
+    send->fd = fd;
+    send->mtime = st.st_mtim;
+    send->size = (uint64_t)st.st_size;
+    send->slot = -1;
+    if (send->size > 0) {
+        // The main thread is the only one filling slots, workers only clear theirs
+        for (int i = 0; i < MAX_FILE_SENDS && send->slot == -1; ++i) {
+            if (__atomic_load_n(&file_sends_mapped[i], __ATOMIC_ACQUIRE) == NULL) {
+                send->slot = i;
+            }
+        }
+        if (send->slot == -1) {
+            printf("[FILE][WARN] %d transfers already in flight; refused %s.\n", MAX_FILE_SENDS, path);
+            file_send_release(send);
+            return false;
+        }
+        void* map = mmap(NULL, send->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("[FILE][ERROR] mmap");
+            send->slot = -1;
+            file_send_release(send);
+            return false;
+        }
+        send->map = map;
+        madvise(send->map, send->size, MADV_SEQUENTIAL);
+        __atomic_store_n(&file_sends_mapped[send->slot], send, __ATOMIC_RELEASE);
+    }
+
+    memcpy(send->name, name, name_len);
+    send->header.magic = htonl(FILE_TRANSFER_MAGIC);
+    send->header.name_len = htonl((uint32_t)name_len);
+    send->header.size = htobe64(send->size);
+    uint64_t regions = (send->size + FILE_SEND_REGION - 1) / FILE_SEND_REGION;
+    send->buffers = calloc(2 + regions, sizeof(QUIC_BUFFER));
+    if (send->buffers == NULL) {
+        file_send_release(send);
+        return false;
+    }
+    send->buffers[0] = (QUIC_BUFFER){.Length = sizeof(send->header), .Buffer = (uint8_t*)&send->header};
+    send->buffers[1] = (QUIC_BUFFER){.Length = (uint32_t)name_len, .Buffer = (uint8_t*)send->name};
+    send->buffer_count = 2;
+    for (uint64_t off = 0; off < send->size; off += FILE_SEND_REGION) {
+        uint64_t len = send->size - off < FILE_SEND_REGION ? send->size - off : FILE_SEND_REGION;
+        send->buffers[send->buffer_count++] = (QUIC_BUFFER){.Length = (uint32_t)len, .Buffer = send->map + off};
+    }
+
+    printf("[FILE] Queued %s as %s.\n", path, name);
+    file_send_submit(send);
+    return true;
+}
+
+// New control connection: non-blocking, parked until its request line is in.
+void accept_file_request() {
+    int control_fd = accept(file_server, NULL, NULL);
+    if (control_fd < 0) {
+        perror("[FILE][ERROR] accept");
+        return;
+    }
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i) {
+        if (file_requests[i].fd == -1) {
+            fcntl(control_fd, F_SETFL, fcntl(control_fd, F_GETFL, 0) | O_NONBLOCK);
+            file_requests[i].fd = control_fd;
+            file_requests[i].have = 0;
+            return;
+        }
+    }
+    printf("[FILE][WARN] %d requests already pending; refused new one.\n", MAX_FILE_REQUESTS);
+    dprintf(control_fd, "ERR\n");
+    close(control_fd);
+}
+
+// One request per control connection: "<source path> [dest name]\n".
+// Called when the fd is readable; starts the transfer once the line is complete.
+void handle_file_request(file_request* req) {
+    ssize_t n = read(req->fd, req->line + req->have, sizeof(req->line) - 1 - req->have);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        req->have += (size_t)n;
+        if (memchr(req->line, '\n', req->have) == NULL && req->have < sizeof(req->line) - 1) {
+            return;
+        }
+    }
+    int control_fd = req->fd;
+    req->fd = -1;
+    char* line = req->line;
+    line[req->have] = '\0';
+    if (memchr(line, '\n', req->have) == NULL) {
+        printf("[FILE][ERROR] Control connection closed or overflowed before a full request line.\n");
+        dprintf(control_fd, "ERR\n");
+        close(control_fd);
+        return;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char* path = line;
+    char* name = strchr(line, ' ');
+    if (name != NULL) {
+        *name++ = '\0';
+    } else {
+        name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    }
+    if (path[0] == '\0' || !start_file_send(control_fd, path, name)) {
+        dprintf(control_fd, "ERR\n");
+        close(control_fd);
+    }
+}
+
 int main() {
     printf("[INIT] Starting QUIC relay client...\n");
+#if LATENCY_TRACE
+    latency_trace_init();
+#endif
+#if TRAFFIC_CAPTURE
+    capture_open(CAPTURE_PATH);
+#endif
+    install_file_sigbus_handler();
     msquic_init();
-    start_quic_client(REMOTE_ADDR, QUIC_PORT);
+    start_quic_client();
 
-    tcp_server = setup_local_tcp_server(LOCAL_TCP_PORT);
+    tcp_server = setup_local_server();
+    file_server = setup_local_tcp_server(LOCAL_FILE_PORT);
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i) {
+        file_requests[i].fd = -1;
+    }
 
     fd_set rfds;
     int maxfd;
+#if LATENCY_TRACE
+    char frame[LATENCY_HEADER_ROOM + BUFFER_SIZE]; // The chunk header is framed in front of the payload
+    char* data = frame + LATENCY_HEADER_ROOM;
+#else
     char data[BUFFER_SIZE];
-    printf("[MAIN] Ready: Accepting TCP on 127.0.0.1:%d, QUIC to %s:%d\n", LOCAL_TCP_PORT, REMOTE_ADDR, QUIC_PORT);
+#endif
+    if (local_is_unix) {
+        printf("[MAIN] Ready: Accepting AF_UNIX on %s, QUIC to %s:%d\n", LOCAL_UNIX_PATH, REMOTE_ADDR, QUIC_PORT);
+    } else {
+        printf("[MAIN] Ready: Accepting TCP on 127.0.0.1:%d, QUIC to %s:%d\n", LOCAL_TCP_PORT, REMOTE_ADDR, QUIC_PORT);
+    }
+    printf("[MAIN] File transfer requests on 127.0.0.1:%d\n", LOCAL_FILE_PORT);
 
     while (1) {
         FD_ZERO(&rfds);
         FD_SET(tcp_server, &rfds);
-        maxfd = tcp_server;
+        FD_SET(file_server, &rfds);
+        maxfd = tcp_server > file_server ? tcp_server : file_server;
+        for (int i = 0; i < MAX_FILE_REQUESTS; ++i) {
+            if (file_requests[i].fd != -1) {
+                FD_SET(file_requests[i].fd, &rfds);
+                if (file_requests[i].fd > maxfd) maxfd = file_requests[i].fd;
+            }
+        }
         if (tcp_client != -1) {
             FD_SET(tcp_client, &rfds);
             if (tcp_client > maxfd) maxfd = tcp_client;
         }
-        int ready = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+        struct timeval tv = {
+            .tv_sec = WARM_CHECK_INTERVAL_MS / 1000,
+            .tv_usec = (WARM_CHECK_INTERVAL_MS % 1000) * 1000
+        };
+        int ready = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+#if LATENCY_TRACE
+        latency_trace_poll();
+#endif
+#if RELAY_FOLLOW_IDEAL_PROCESSOR
+        relay_placement_poll();
+#endif
         if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("[MAIN][ERROR] select");
             break;
         }
+        warm_connection_tick();
+        if (ready == 0) {
+            continue;
+        }
+        // File transfer requests
+        for (int i = 0; i < MAX_FILE_REQUESTS; ++i) {
+            if (file_requests[i].fd != -1 && FD_ISSET(file_requests[i].fd, &rfds)) {
+                handle_file_request(&file_requests[i]);
+            }
+        }
+        if (FD_ISSET(file_server, &rfds)) {
+            accept_file_request();
+        }
         // Accept new TCP connection
         if (FD_ISSET(tcp_server, &rfds)) {
             if (tcp_client == -1) {
@@ -278,6 +1368,12 @@ int main() {
                     tcp_client = -1;
                 } else {
                     printf("[TCP] Accepted new local TCP client.\n");
+#if TRAFFIC_CAPTURE
+                    capture_event(CAPTURE_EVENT_SESSION_OPEN, ++capture_session, NULL, 0);
+#endif
+                    // The session owns its stream from the start, so bytes the
+                    // server's backend sends first reach this client
+                    ensure_quic_stream();
                 }
             } else {
                 int tmp = accept(tcp_server, NULL, NULL);
@@ -287,13 +1383,29 @@ int main() {
         }
         // Read from local TCP client and send to QUIC
         if (tcp_client != -1 && FD_ISSET(tcp_client, &rfds)) {
-            ssize_t nread = read(tcp_client, data, sizeof(data));
+            ssize_t nread = read(tcp_client, data, BUFFER_SIZE);
             if (nread > 0) {
+#if LATENCY_TRACE
+                uint64_t t_read = latency_now_ns();
+#endif
+#if TRAFFIC_CAPTURE
+                capture_event(CAPTURE_EVENT_TCP_READ, capture_session, data, (uint32_t)nread);
+#endif
                 printf("[RELAY] Read %zd bytes from TCP client, relaying to QUIC peer...\n", nread);
                 ensure_quic_stream();
                 if (QuicStream != NULL) {
+#if LATENCY_TRACE
+                    latency_send_ctx* trace;
+                    QUIC_BUFFER buf;
+                    buf.Buffer = latency_send_frame((uint8_t*)data, (uint32_t)nread, t_read, &buf.Length, &trace);
+                    QUIC_STATUS qs = MsQuic->StreamSend(QuicStream, &buf, 1, QUIC_SEND_FLAG_NONE, trace);
+                    if (QUIC_FAILED(qs)) {
+                        free(trace);
+                    }
+#else
                     QUIC_BUFFER buf = {.Length = (uint32_t)nread, .Buffer = (uint8_t*)data};
                     QUIC_STATUS qs = MsQuic->StreamSend(QuicStream, &buf, 1, QUIC_SEND_FLAG_NONE, NULL);
+#endif
                     if (QUIC_FAILED(qs)) {
                         fprintf(stderr, "[QUIC][ERROR] StreamSend failed (status=0x%x)\n", qs);
                         if (QuicStream) {
@@ -301,6 +1413,7 @@ int main() {
                             QuicStream = NULL;
                         }
                     } else {
+                        active_bytes_sent += (uint64_t)nread;
                         printf("[RELAY] Sent %zd bytes to QUIC peer.\n", nread);
                     }
                 } else {
@@ -317,7 +1430,15 @@ int main() {
     }
     msquic_cleanup();
     if (tcp_server != -1) close(tcp_server);
+    if (file_server != -1) close(file_server);
+    for (int i = 0; i < MAX_FILE_REQUESTS; ++i) {
+        if (file_requests[i].fd != -1) close(file_requests[i].fd);
+    }
     if (tcp_client != -1) close(tcp_client);
+    if (local_is_unix) unlink(LOCAL_UNIX_PATH);
+#if TRAFFIC_CAPTURE
+    capture_close();
+#endif
     printf("[EXIT] QUIC relay client exiting.\n");
     return 0;
 }
@@ -0,0 +1,327 @@
+// Compile with: gcc quic_replay.c -o quic_replay
+// Usage: quic_replay <trace> [--fast] [--respond] [--port N | --unix PATH]
+//
+// Replays a trace recorded by a relay built with -DTRAFFIC_CAPTURE=1 into a
+// local relay endpoint (by default quic_client on 127.0.0.1:44444). Every
+// captured session is reopened as a local connection and its TCP_READ chunks
+// are written with their original sizes, payloads if the trace has them and
+// zero filler otherwise. Without --fast the original inter-arrival gaps are
+// kept; with --fast chunks are pushed back to back. Data coming back from the
+// relay is drained and counted against the trace's TCP_WRITE bytes.
+//
+// With --respond the same client-side trace plays the backend instead: one
+// connection to quic_server's backend port (127.0.0.1:8081 by default) reads
+// the replayed requests and answers with the trace's TCP_WRITE chunks, each
+// sent only once every TCP_READ byte recorded before it has arrived. Start
+// the responder first, then the driver against quic_client; both report
+// what they received against what the trace says the other side sent.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "traffic_capture.h"
+
+// CONFIG
+#define DEFAULT_PORT 44444
+#define DEFAULT_RESPOND_PORT 8081   // quic_server's LOCAL_TCP_PORT
+#define MAX_SESSIONS 65536
+#define FILLER_SIZE 65536
+#define CLOSE_WAIT_MS 5000   // How long to wait for the relay to close a finished session
+
+static int session_fd[MAX_SESSIONS];
+static uint16_t open_sessions[MAX_SESSIONS];
+static int open_count = 0;
+static uint8_t filler[FILLER_SIZE];
+
+static uint16_t target_port = 0;
+static const char* target_unix_path = NULL;
+
+static uint64_t bytes_sent = 0;
+static uint64_t bytes_received = 0;
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int connect_target() {
+    int sock;
+    if (target_unix_path != NULL) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("[REPLAY][ERROR] socket");
+            return -1;
+        }
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, target_unix_path, sizeof(addr.sun_path) - 1);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("[REPLAY][ERROR] connect");
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("[REPLAY][ERROR] socket");
+        return -1;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(target_port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[REPLAY][ERROR] connect");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Reads whatever the relay has sent back so it never stalls on our receive window.
+void drain_sessions() {
+    char buf[FILLER_SIZE];
+    for (int i = 0; i < open_count; ++i) {
+        while (1) {
+            ssize_t n = recv(session_fd[open_sessions[i]], buf, sizeof(buf), MSG_DONTWAIT);
+            if (n <= 0) break;
+            bytes_received += (uint64_t)n;
+        }
+    }
+}
+
+// Responder: waits until the replayed requests preceding a response have
+// arrived, so answers follow the requests they belong to. After one timeout
+// the rest of the trace is answered without waiting.
+void wait_for_peer(uint64_t needed) {
+    static bool peer_stalled = false;
+    if (peer_stalled) return;
+    char buf[FILLER_SIZE];
+    uint64_t deadline = monotonic_ns() + CLOSE_WAIT_MS * 1000000ULL;
+    while (bytes_received < needed && open_count > 0) {
+        uint64_t now = monotonic_ns();
+        int fd = session_fd[open_sessions[0]];
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = now < deadline ? poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            fprintf(stderr, "[REPLAY][WARN] Only %llu of %llu request bytes arrived within %d ms, no longer waiting.\n",
+                    (unsigned long long)bytes_received, (unsigned long long)needed, CLOSE_WAIT_MS);
+            peer_stalled = true;
+            return;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            fprintf(stderr, "[REPLAY][WARN] Relay closed the backend connection.\n");
+            return;
+        }
+        bytes_received += (uint64_t)n;
+    }
+}
+
+bool open_session(uint16_t session) {
+    session_fd[session] = connect_target();
+    if (session_fd[session] == -1) return false;
+    open_sessions[open_count++] = session;
+    return true;
+}
+
+// Half-closes the session and waits for the relay to close its end. The
+// relay serves one local session at a time and refuses a new one until it
+// has processed the previous EOF, so opening the next session any sooner
+// would lose it.
+void close_session(uint16_t session) {
+    if (session_fd[session] == -1) return;
+    drain_sessions();
+    int fd = session_fd[session];
+    shutdown(fd, SHUT_WR);
+    char buf[FILLER_SIZE];
+    uint64_t deadline = monotonic_ns() + CLOSE_WAIT_MS * 1000000ULL;
+    while (1) {
+        uint64_t now = monotonic_ns();
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = now < deadline ? poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) {
+            fprintf(stderr, "[REPLAY][WARN] Relay did not close session %u within %d ms.\n", session, CLOSE_WAIT_MS);
+            break;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) break;
+        bytes_received += (uint64_t)n;
+    }
+    close(fd);
+    session_fd[session] = -1;
+    for (int i = 0; i < open_count; ++i) {
+        if (open_sessions[i] == session) {
+            open_sessions[i] = open_sessions[--open_count];
+            break;
+        }
+    }
+}
+
+bool send_chunk(uint16_t session, const uint8_t* payload, uint32_t length) {
+    if (session_fd[session] == -1) {
+        // Capture started mid-session: open it on first use
+        if (!open_session(session)) return false;
+    }
+    uint32_t sent = 0;
+    while (sent < length) {
+        const uint8_t* src = payload ? payload + sent : filler;
+        uint32_t chunk = length - sent;
+        if (payload == NULL && chunk > FILLER_SIZE) chunk = FILLER_SIZE;
+        ssize_t n = write(session_fd[session], src, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[REPLAY][ERROR] write");
+            close_session(session);
+            return false;
+        }
+        sent += (uint32_t)n;
+    }
+    bytes_sent += length;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* trace_path = NULL;
+    bool fast = false;
+    bool respond = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            fast = true;
+        } else if (strcmp(argv[i], "--respond") == 0) {
+            respond = true;
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            target_port = (uint16_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            target_unix_path = argv[++i];
+        } else if (trace_path == NULL) {
+            trace_path = argv[i];
+        } else {
+            trace_path = NULL;
+            break;
+        }
+    }
+    if (trace_path == NULL) {
+        fprintf(stderr, "Usage: %s <trace> [--fast] [--respond] [--port N | --unix PATH]\n", argv[0]);
+        return 1;
+    }
+    if (target_port == 0) {
+        target_port = respond ? DEFAULT_RESPOND_PORT : DEFAULT_PORT;
+    }
+    // The driver plays the trace's local peer, the responder the far end's backend
+    uint8_t send_event = respond ? CAPTURE_EVENT_TCP_WRITE : CAPTURE_EVENT_TCP_READ;
+    uint8_t expect_event = respond ? CAPTURE_EVENT_TCP_READ : CAPTURE_EVENT_TCP_WRITE;
+
+    int fd = open(trace_path, O_RDONLY);
+    if (fd < 0) {
+        perror("[REPLAY][ERROR] open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(capture_file_header)) {
+        fprintf(stderr, "[REPLAY][ERROR] %s is not a relay trace\n", trace_path);
+        return 1;
+    }
+    const uint8_t* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("[REPLAY][ERROR] mmap");
+        return 1;
+    }
+    const capture_file_header* header = (const capture_file_header*)map;
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->version != CAPTURE_VERSION) {
+        fprintf(stderr, "[REPLAY][ERROR] %s: bad magic or unsupported version\n", trace_path);
+        return 1;
+    }
+    uint64_t data_end = header->data_end;
+    if (sizeof(*header) + data_end > (uint64_t)st.st_size) {
+        data_end = st.st_size - sizeof(*header);
+    }
+    printf("[REPLAY] Trace %s: %llu bytes of records, payloads %s, mode %s%s.\n", trace_path,
+           (unsigned long long)data_end, (header->flags & CAPTURE_FLAG_PAYLOADS) ? "on" : "off",
+           fast ? "as fast as possible" : "original timing", respond ? ", responding as the backend" : "");
+
+    for (int i = 0; i < MAX_SESSIONS; ++i) session_fd[i] = -1;
+    signal(SIGPIPE, SIG_IGN); // A relay dropping a session shows up as a write error instead
+    // The server relay keeps one backend connection across all client sessions
+    if (respond && !open_session(0)) {
+        return 1;
+    }
+
+    const uint8_t* cursor = map + sizeof(*header);
+    const uint8_t* end = cursor + data_end;
+    uint64_t records = 0, sessions = 0, expected_back = 0;
+    uint64_t replay_start = monotonic_ns();
+    // Timing is relative to the first record, not to when the capture was opened
+    uint64_t first_t_ns = cursor + sizeof(capture_record) <= end ? ((const capture_record*)cursor)->t_ns : 0;
+    while (cursor + sizeof(capture_record) <= end) {
+        const capture_record* rec = (const capture_record*)cursor;
+        uint64_t payload_bytes = capture_payload_bytes(header, rec);
+        if (cursor + sizeof(*rec) + payload_bytes > end) break;
+        const uint8_t* payload = payload_bytes ? cursor + sizeof(*rec) : NULL;
+        cursor += sizeof(*rec) + payload_bytes;
+        records++;
+
+        if (!fast) {
+            uint64_t due = replay_start + (rec->t_ns - first_t_ns);
+            drain_sessions();
+            struct timespec ts = {.tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            }
+        }
+
+        if (rec->event == CAPTURE_EVENT_SESSION_OPEN || rec->event == CAPTURE_EVENT_SESSION_CLOSE) {
+            if (respond) continue;
+            close_session(rec->session);
+            if (rec->event == CAPTURE_EVENT_SESSION_OPEN && open_session(rec->session)) sessions++;
+        } else if (rec->event == send_event) {
+            if (respond) {
+                wait_for_peer(expected_back);
+                send_chunk(0, payload, rec->length);
+            } else {
+                send_chunk(rec->session, payload, rec->length);
+            }
+            if (fast) drain_sessions();
+        } else if (rec->event == expect_event) {
+            expected_back += rec->length;
+        } else {
+            fprintf(stderr, "[REPLAY][WARN] Unknown record event %u, skipped.\n", rec->event);
+        }
+    }
+    if (respond) {
+        wait_for_peer(expected_back);
+        sessions = 1;
+    }
+    while (open_count > 0) close_session(open_sessions[0]);
+
+    double elapsed = (monotonic_ns() - replay_start) / 1e9;
+    printf("[REPLAY] Done: %llu records, %llu sessions in %.3f s.\n",
+           (unsigned long long)records, (unsigned long long)sessions, elapsed);
+    printf("[REPLAY] Sent %llu bytes (%.2f MB/s), received %llu of %llu bytes seen in the trace.\n",
+           (unsigned long long)bytes_sent, elapsed > 0 ? bytes_sent / elapsed / 1e6 : 0.0,
+           (unsigned long long)bytes_received, (unsigned long long)expected_back);
+    munmap((void*)map, st.st_size);
+    close(fd);
+    return 0;
+}
@@ -1,5 +1,8 @@
 // Compile with: gcc quicserver.c -o quicserver -lmsquic -lpthread
+// Latency tracing: add -DLATENCY_TRACE=1 (the client must be built the same way)
+// Traffic capture: add -DTRAFFIC_CAPTURE=1 (and -DCAPTURE_PAYLOADS=1 to keep the bytes), replay with quic_replay
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,19 +14,60 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <endian.h>
+#include <signal.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <msquic.h>
+#include "latency_trace.h"
+#include "traffic_capture.h"
+#include "file_transfer.h"
+#include "cpu_placement.h"
 
 // CONFIG - Make server IP configurable  
 #define QUIC_PORT 50072
 #define LOCAL_TCP_PORT 8081
-#define SERVER_IP "0.0.0.0"
+#define LOCAL_UNIX_PATH ""             // e.g. "/tmp/quic_server.sock" to accept the backend over AF_UNIX instead of TCP
+#define SERVER_IP ""                  // "" = every IPv4 and IPv6 address (dual-stack), or one address such as "0.0.0.0"
 #define BUFFER_SIZE 4096
 #define CERT_FILE "server_cert.pem"
 #define KEY_FILE "server_key.pem"
 #define MAX_BUFFER_SIZE 8192
+#define PEER_BIDI_STREAM_COUNT 10      // Initial bidi stream credit per connection
+#define PEER_BIDI_STREAM_STEP 10       // Extra credit granted each time the client reports it is blocked
+#define MAX_PEER_BIDI_STREAMS 100      // Upper bound for the grown credit
+#define FILE_RECV_DIR "received"       // Where files sent with the client's file transfer mode are written
+
+// Admission control: NEW_CONNECTION is refused at MAX_ACTIVE_CONNECTIONS or
+// while the relay is overloaded, and msquic itself refuses handshakes once a
+// worker's queue delay passes MAX_WORKER_QUEUE_DELAY_US. The relay counts as
+// overloaded once its backlog toward an attached backend passes
+// BUFFERED_BYTES_HIGH_WATERMARK, and stays so until it drains below
+// BUFFERED_BYTES_LOW_WATERMARK. Bytes buffered while no backend is attached
+// are only waiting for one and never count. While overloaded the server sheds
+// load every SHED_CHECK_INTERVAL_MS, lowest priority first: bulk file
+// transfers, then connections not carrying the relay. The relay connection
+// is never shed.
+#define MAX_ACTIVE_CONNECTIONS 16
+#define BUFFERED_BYTES_HIGH_WATERMARK (MAX_BUFFER_SIZE * 3 / 4)
+#define BUFFERED_BYTES_LOW_WATERMARK (MAX_BUFFER_SIZE / 4)
+#define MAX_WORKER_QUEUE_DELAY_US 10000
+#define SHED_CHECK_INTERVAL_MS 1000
+
+// CPU placement
+#define QUIC_WORKER_CPUS ""            // e.g. "2,3" to run msquic workers only on these CPUs ("" = msquic default)
+#define RELAY_FOLLOW_IDEAL_PROCESSOR 0 // 1 = pin the relay thread next to the active connection's msquic worker (see cpu_placement.h)
+
+// Graceful drain: SIGTERM stops the listener and lets the relay and any file
+// transfers finish before the server exits.
+#define DRAIN_TIMEOUT_MS 30000         // Max time a draining server waits for its relay and file transfers
 
 // Data buffering
 static char pending_data[MAX_BUFFER_SIZE];
@@ -36,13 +80,32 @@ HQUIC Configuration = NULL;
 HQUIC Listener = NULL;
 HQUIC QuicStream = NULL;
 HQUIC CurrentConnection = NULL;
+HQUIC session_connection = NULL;   // Connection and ID of the stream the relay last switched to
+uint64_t session_stream_id = 0;
+struct relay_stream* relay_streams = NULL; // Every live relay stream, newest first
+// Guards relay_streams and the session's QuicStream / CurrentConnection / session_* fields
+pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // TCP relay globals
 int tcp_server = -1;
 int tcp_client = -1;
+bool local_is_unix = false;
+
+// Admission state, shared by msquic callbacks and the main loop under admission_lock
+HQUIC active_connections[MAX_ACTIVE_CONNECTIONS];
+bool active_connection_shed[MAX_ACTIVE_CONNECTIONS];
+int active_connection_count = 0;
+struct file_recv* file_transfers = NULL;
+pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drain state
+volatile sig_atomic_t drain_requested = 0;
 
 void close_tcp_client() {
     if (tcp_client != -1) {
+#if TRAFFIC_CAPTURE
+        capture_event(CAPTURE_EVENT_SESSION_CLOSE, capture_session, NULL, 0);
+#endif
         printf("[TCP][DEBUG] Closing connection with local TCP client (fd=%d).\n", tcp_client);
         close(tcp_client);
         tcp_client = -1;
@@ -80,6 +143,100 @@ int setup_local_tcp_server(uint16_t port) {
     return sock;
 }
 
+// **AF_UNIX LISTENER FOR A CO-LOCATED BACKEND - NO LOOPBACK TCP OVERHEAD**
+int setup_local_unix_server(const char* path) {
+    printf("[UNIX] Creating local AF_UNIX server socket at %s\n", path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("[UNIX][ERROR] socket");
+        exit(1);
+    }
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[UNIX][ERROR] Socket path too long: %s\n", path);
+        close(sock);
+        exit(1);
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path); // Remove a stale socket left by a previous run
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[UNIX][ERROR] bind");
+        close(sock);
+        exit(1);
+    }
+    if (listen(sock, 5) < 0) {
+        perror("[UNIX][ERROR] listen");
+        close(sock);
+        exit(1);
+    }
+    printf("[UNIX] Local AF_UNIX server listening on fd=%d.\n", sock);
+    local_is_unix = true;
+    return sock;
+}
+
+int setup_local_server() {
+    if (LOCAL_UNIX_PATH[0] != '\0') {
+        return setup_local_unix_server(LOCAL_UNIX_PATH);
+    }
+    return setup_local_tcp_server(LOCAL_TCP_PORT);
+}
+
+void handle_drain_signal(int sig) {
+    drain_requested = 1;
+}
+
+// **NO SA_RESTART SO SELECT() WAKES UP ON SIGTERM**
+void install_drain_handler() {
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_drain_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// **APPLY QUIC_WORKER_CPUS BEFORE REGISTRATION SO MSQUIC CREATES ITS WORKERS THERE**
+void apply_worker_cpu_config() {
+    const char* list = QUIC_WORKER_CPUS;
+    if (list[0] == '\0') {
+        return;
+    }
+    uint16_t cpus[CPU_SETSIZE];
+    uint32_t count = 0;
+    const char* p = list;
+    while (*p != '\0' && count < CPU_SETSIZE) {
+        char* end;
+        long cpu = strtol(p, &end, 10);
+        if (end == p || cpu < 0 || cpu >= CPU_SETSIZE) {
+            fprintf(stderr, "[CPU][ERROR] Invalid QUIC_WORKER_CPUS entry in \"%s\"\n", list);
+            exit(1);
+        }
+        cpus[count++] = (uint16_t)cpu;
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    uint32_t size = QUIC_GLOBAL_EXECUTION_CONFIG_MIN_SIZE + count * sizeof(uint16_t);
+    QUIC_GLOBAL_EXECUTION_CONFIG* config = calloc(1, size);
+    if (config == NULL) {
+        fprintf(stderr, "[CPU][ERROR] Out of memory for execution config\n");
+        exit(1);
+    }
+    config->ProcessorCount = count;
+    memcpy(config->ProcessorList, cpus, count * sizeof(uint16_t));
+    QUIC_STATUS status = MsQuic->SetParam(NULL, QUIC_PARAM_GLOBAL_EXECUTION_CONFIG, size, config);
+    free(config);
+    if (QUIC_FAILED(status)) {
+        fprintf(stderr, "[CPU][ERROR] Setting QUIC_PARAM_GLOBAL_EXECUTION_CONFIG failed: 0x%x\n", status);
+        exit(1);
+    }
+    printf("[CPU] msquic workers restricted to CPUs %s\n", list);
+}
+
 void msquic_cleanup() {
     printf("[CLEANUP] Cleaning up msquic resources...\n");
     if (Listener) {
@@ -91,6 +248,9 @@ void msquic_cleanup() {
         MsQuic->ConfigurationClose(Configuration);
     }
     if (Registration) {
+        // **RegistrationClose BLOCKS UNTIL EVERY CONNECTION IS GONE - STANDBY AND FILE CONNECTIONS INCLUDED**
+        printf("[CLEANUP] Shutting down remaining connections...\n");
+        MsQuic->RegistrationShutdown(Registration, QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
         printf("[CLEANUP] Closing Registration...\n");
         MsQuic->RegistrationClose(Registration);
     }
@@ -101,10 +261,163 @@ void msquic_cleanup() {
     printf("[CLEANUP] Done cleaning up msquic resources.\n");
 }
 
+// **RELAY ONE RECEIVED BUFFER TO THE TCP CLIENT, BUFFERING ON BACKPRESSURE**
+void relay_to_tcp_client(const uint8_t* buf, uint32_t len) {
+    if (tcp_client != -1) {
+        printf("[QUIC][DEBUG] Writing to tcp_client (fd=%d)\n", tcp_client);
+        ssize_t nwritten = write(tcp_client, buf, len);
+        
+        printf("[QUIC][DEBUG] write() returned: %zd (errno=%d: %s)\n", 
+               nwritten, errno, strerror(errno));
+#if TRAFFIC_CAPTURE
+        // **CAPTURE ONLY WHAT THE BACKEND GOT - BUFFERED BYTES ARE CAPTURED WHEN FLUSHED**
+        if (nwritten > 0) {
+            capture_event(CAPTURE_EVENT_TCP_WRITE, capture_session, buf, (uint32_t)nwritten);
+        }
+#endif
+        
+        if (nwritten < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                printf("[TCP][WARN] TCP client buffer full, buffering data...\n");
+                if (pending_data_len + len < MAX_BUFFER_SIZE) {
+                    memcpy(pending_data + pending_data_len, buf, len);
+                    pending_data_len += len;
+                    printf("[RELAY][BUFFER] Buffered %u bytes due to TCP backpressure (total: %zu)\n", 
+                           len, pending_data_len);
+                } else {
+                    printf("[RELAY][ERROR] Buffer full, dropping data!\n");
+                }
+            } else {
+                perror("[TCP][ERROR] write to tcp_client");
+                close_tcp_client();
+            }
+        } else if ((size_t)nwritten < len) {
+            printf("[TCP][WARN] Partial write (%zd/%u bytes), buffering remainder...\n",
+                   nwritten, len);
+            size_t remaining = len - nwritten;
+            if (pending_data_len + remaining < MAX_BUFFER_SIZE) {
+                memcpy(pending_data + pending_data_len,
+                       buf + nwritten,
+                       remaining);
+                pending_data_len += remaining;
+                printf("[RELAY][BUFFER] Buffered %zu remaining bytes (total: %zu)\n",
+                       remaining, pending_data_len);
+            }
+            printf("[RELAY] Successfully wrote %zd bytes to TCP client.\n", nwritten);
+        } else {
+            printf("[RELAY] Successfully wrote %zd bytes to TCP client.\n", nwritten);
+        }
+    } else {
+        printf("[QUIC][DEBUG] No TCP client, buffering data\n");
+        if (pending_data_len + len < MAX_BUFFER_SIZE) {
+            memcpy(pending_data + pending_data_len, buf, len);
+            pending_data_len += len;
+            printf("[RELAY][BUFFER] Buffered %u bytes (total: %zu). Waiting for TCP client...\n", 
+                   len, pending_data_len);
+        } else {
+            printf("[RELAY][WARN] Buffer full, data dropped.\n");
+        }
+    }
+}
+
+// **PER-STREAM RELAY STATE, THE ServerStreamCallback CONTEXT**
+typedef struct relay_stream {
+    HQUIC stream;
+    HQUIC connection;
+    uint64_t id;
+    bool finished;              // The client ended (or aborted) its session on this stream
+    struct relay_stream* next;  // relay_streams list
+#if LATENCY_TRACE
+    latency_rx trace_rx;        // Every stream starts on a chunk boundary
+#endif
+} relay_stream;
+
+// Called with session_lock held.
+void set_session_stream_locked(relay_stream* rs) {
+    if (rs == NULL) {
+        QuicStream = NULL;
+        return;
+    }
+    if (rs->stream == QuicStream) {
+        return;
+    }
+    printf("[QUIC] Session moved to stream %p (id %llu, previous %p).\n",
+           (void*)rs->stream, (unsigned long long)rs->id, (void*)QuicStream);
+    QuicStream = rs->stream;
+    // **CLIENTS KEEP WARM STANDBY CONNECTIONS - FOLLOW THE ONE CARRYING THE STREAM**
+    CurrentConnection = rs->connection;
+    session_connection = rs->connection;
+    session_stream_id = rs->id;
+}
+
+// **THE NEXT SESSION IS THE LOWEST-ID UNFINISHED STREAM OF THE CURRENT CONNECTION**
+// The client starts its pooled streams IMMEDIATE and hands them out lowest ID
+// first, so the relay points at a session's stream before the client sends
+// anything and backend bytes written first are not dropped. If the current
+// connection has no stream left (the client rotated to its standby), follow
+// the connection of the newest stream. Called with session_lock held.
+void pick_session_stream_locked() {
+    relay_stream* best = NULL;
+    for (relay_stream* rs = relay_streams; rs != NULL; rs = rs->next) {
+        if (!rs->finished && rs->connection == CurrentConnection && (best == NULL || rs->id < best->id)) {
+            best = rs;
+        }
+    }
+    HQUIC newest = NULL;
+    for (relay_stream* rs = relay_streams; best == NULL && rs != NULL; rs = rs->next) {
+        if (!rs->finished && newest == NULL) {
+            newest = rs->connection;
+        }
+    }
+    for (relay_stream* rs = relay_streams; newest != NULL && rs != NULL; rs = rs->next) {
+        if (!rs->finished && rs->connection == newest && (best == NULL || rs->id < best->id)) {
+            best = rs;
+        }
+    }
+    set_session_stream_locked(best);
+}
+
+// **DATA ON ANOTHER STREAM OVERRIDES THE PICK - THE CLIENT SKIPPED AHEAD (E.G. ITS POOL RAN DRY)**
+// Late bytes on an older stream of the same connection are still relayed,
+// but the relay does not switch back to that stream.
+void adopt_session_stream(relay_stream* rs) {
+    pthread_mutex_lock(&session_lock);
+    if (rs->stream != QuicStream && (rs->connection != session_connection || rs->id > session_stream_id)) {
+        set_session_stream_locked(rs);
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
+// **CLIENT ENDED ITS SESSION ON THIS STREAM - MOVE THE RELAY TO THE NEXT ONE**
+void finish_session_stream(relay_stream* rs, bool unlink) {
+    pthread_mutex_lock(&session_lock);
+    rs->finished = true;
+    if (unlink) {
+        for (relay_stream** link = &relay_streams; *link != NULL; link = &(*link)->next) {
+            if (*link == rs) {
+                *link = rs->next;
+                break;
+            }
+        }
+    }
+    if (rs->stream == QuicStream) {
+        pick_session_stream_locked();
+        if (QuicStream == NULL) {
+            printf("[QUIC] Session stream finished, waiting for the next one.\n");
+        }
+    }
+    pthread_mutex_unlock(&session_lock);
+}
+
 QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event) {
     printf("[QUIC][DEBUG] ========== STREAM CALLBACK START ==========\n");
     printf("[QUIC][DEBUG] Stream callback invoked: Stream=%p, Event->Type=%d\n", (void*)Stream, Event->Type);
     printf("[QUIC][DEBUG] Current QuicStream=%p, tcp_client=%d\n", (void*)QuicStream, tcp_client);
+    relay_stream* rs = Context;
+    
+    if (Event->Type == QUIC_STREAM_EVENT_RECEIVE && Stream != QuicStream) {
+        adopt_session_stream(rs);
+    }
     
     // **CHECK IF THIS IS STILL OUR ACTIVE STREAM**
     if (Stream != QuicStream) {
@@ -117,6 +430,9 @@ QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
             printf("[QUIC] Received %llu bytes from remote peer. Current stream=%p\n",
                    (unsigned long long)Event->RECEIVE.TotalBufferLength, (void*)QuicStream);
             printf("[QUIC][DEBUG] BufferCount=%u\n", Event->RECEIVE.BufferCount);
+#if LATENCY_TRACE
+            uint64_t t_recv = latency_now_ns();
+#endif
             
             for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
                 printf("[QUIC][DEBUG] Processing buffer %u: %u bytes\n", i, Event->RECEIVE.Buffers[i].Length);
@@ -133,61 +449,16 @@ QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
                 }
                 printf("\n");
                 
-                if (tcp_client != -1) {
-                    printf("[QUIC][DEBUG] Writing to tcp_client (fd=%d)\n", tcp_client);
-                    ssize_t nwritten = write(tcp_client,
-                        Event->RECEIVE.Buffers[i].Buffer,
-                        Event->RECEIVE.Buffers[i].Length);
-                    
-                    printf("[QUIC][DEBUG] write() returned: %zd (errno=%d: %s)\n", 
-                           nwritten, errno, strerror(errno));
-                    
-                    if (nwritten < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            printf("[TCP][WARN] TCP client buffer full, buffering data...\n");
-                            if (pending_data_len + Event->RECEIVE.Buffers[i].Length < MAX_BUFFER_SIZE) {
-                                memcpy(pending_data + pending_data_len, 
-                                       Event->RECEIVE.Buffers[i].Buffer, 
-                                       Event->RECEIVE.Buffers[i].Length);
-                                pending_data_len += Event->RECEIVE.Buffers[i].Length;
-                                printf("[RELAY][BUFFER] Buffered %u bytes due to TCP backpressure (total: %zu)\n", 
-                                       Event->RECEIVE.Buffers[i].Length, pending_data_len);
-                            } else {
-                                printf("[RELAY][ERROR] Buffer full, dropping data!\n");
-                            }
-                        } else {
-                            perror("[TCP][ERROR] write to tcp_client");
-                            close_tcp_client();
-                        }
-                    } else if ((size_t)nwritten < Event->RECEIVE.Buffers[i].Length) {
-                        printf("[TCP][WARN] Partial write (%zd/%u bytes), buffering remainder...\n",
-                               nwritten, Event->RECEIVE.Buffers[i].Length);
-                        size_t remaining = Event->RECEIVE.Buffers[i].Length - nwritten;
-                        if (pending_data_len + remaining < MAX_BUFFER_SIZE) {
-                            memcpy(pending_data + pending_data_len,
-                                   Event->RECEIVE.Buffers[i].Buffer + nwritten,
-                                   remaining);
-                            pending_data_len += remaining;
-                            printf("[RELAY][BUFFER] Buffered %zu remaining bytes (total: %zu)\n",
-                                   remaining, pending_data_len);
-                        }
-                        printf("[RELAY] Successfully wrote %zd bytes to TCP client.\n", nwritten);
-                    } else {
-                        printf("[RELAY] Successfully wrote %zd bytes to TCP client.\n", nwritten);
-                    }
-                } else {
-                    printf("[QUIC][DEBUG] No TCP client, buffering data\n");
-                    if (pending_data_len + Event->RECEIVE.Buffers[i].Length < MAX_BUFFER_SIZE) {
-                        memcpy(pending_data + pending_data_len, 
-                               Event->RECEIVE.Buffers[i].Buffer, 
-                               Event->RECEIVE.Buffers[i].Length);
-                        pending_data_len += Event->RECEIVE.Buffers[i].Length;
-                        printf("[RELAY][BUFFER] Buffered %u bytes (total: %zu). Waiting for TCP client...\n", 
-                               Event->RECEIVE.Buffers[i].Length, pending_data_len);
-                    } else {
-                        printf("[RELAY][WARN] Buffer full, data dropped.\n");
-                    }
+#if LATENCY_TRACE
+                if (!latency_rx_feed(&rs->trace_rx, Event->RECEIVE.Buffers[i].Buffer, Event->RECEIVE.Buffers[i].Length,
+                                     t_recv, relay_to_tcp_client)) {
+                    // **MISPARSED BYTES WOULD CORRUPT THE SESSION - DROP THE STREAM INSTEAD**
+                    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, LATENCY_TRACE_ERROR_FRAMING);
+                    break;
                 }
+#else
+                relay_to_tcp_client(Event->RECEIVE.Buffers[i].Buffer, Event->RECEIVE.Buffers[i].Length);
+#endif
             }
             
             printf("[QUIC][DEBUG] Calling StreamReceiveComplete for %llu bytes\n", 
@@ -199,21 +470,24 @@ QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
         case QUIC_STREAM_EVENT_SEND_COMPLETE:
             printf("[QUIC][DEBUG] *** SEND_COMPLETE EVENT ***\n");
             printf("[QUIC] Send completed successfully.\n");
+#if LATENCY_TRACE
+            latency_send_complete(Event->SEND_COMPLETE.ClientContext, Event->SEND_COMPLETE.Canceled);
+#endif
             break;
             
         case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
             printf("[QUIC][CRITICAL] *** PEER_SEND_SHUTDOWN EVENT ***\n");
             printf("[QUIC][CRITICAL] Peer shut down send direction! Stream may become unusable.\n");
+            // **CLIENT FINISHED ITS SESSION - FINISH OUR SIDE TOO SO THE STREAM CREDIT IS RETURNED**
+            MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+            finish_session_stream(rs, false);
             break;
             
         case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
             printf("[QUIC][CRITICAL] *** PEER_SEND_ABORTED EVENT ***\n");
             printf("[QUIC][CRITICAL] Peer aborted send! Stream is broken.\n");
             // Mark stream as broken
-            if (Stream == QuicStream) {
-                printf("[QUIC][CRITICAL] Clearing broken QuicStream reference\n");
-                QuicStream = NULL;
-            }
+            finish_session_stream(rs, false);
             break;
             
         case QUIC_STREAM_EVENT_SEND_SHUTDOWN_COMPLETE:
@@ -224,11 +498,9 @@ QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
         case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
             printf("[QUIC][CRITICAL] *** SHUTDOWN_COMPLETE EVENT ***\n");
             printf("[QUIC][CRITICAL] Stream shutdown complete. Stream is being destroyed.\n");
-            if (Stream == QuicStream) {
-                printf("[QUIC][CRITICAL] Our active stream is being destroyed!\n");
-                QuicStream = NULL;
-            }
+            finish_session_stream(rs, true);
             MsQuic->StreamClose(Stream);
+            free(rs);
             printf("[QUIC][DEBUG] Stream handle closed\n");
             break;
             
@@ -242,6 +514,477 @@ QUIC_STATUS QUIC_API ServerStreamCallback(HQUIC Stream, void* Context, QUIC_STRE
     return QUIC_STATUS_SUCCESS;
 }
 
+// **ONE INCOMING FILE TRANSFER (SEE file_transfer.h), OWNED BY ITS STREAM**
+typedef struct file_recv {
+    HQUIC stream;
+    struct file_recv* next; // file_transfers list, for the load shedder
+    bool shed;
+    bool complete;          // File closed and FILE_TRANSFER_STATUS_OK sent, nothing left to shed
+    uint8_t header_bytes[sizeof(file_transfer_header)];
+    char name[FILE_TRANSFER_MAX_NAME + 1];
+    uint32_t name_len;
+    uint64_t size;
+    uint64_t data_offset;   // Stream offset of the first content byte, 0 until the header is in
+    uint64_t written;
+    int fd;
+    char path[FILE_TRANSFER_MAX_NAME + sizeof(FILE_RECV_DIR) + 2];
+    // Writer thread handoff, under file_write_lock
+    struct file_write* write;   // Content of the RECEIVE being written, msquic holds its buffers
+    bool discard_requested;     // Discard once the write in flight is done
+    bool closed;                // Stream shut down meanwhile, the writer frees it
+} file_recv;
+
+// **CONTENT OF ONE RECEIVE EVENT, WRITTEN BY file_writer_thread**
+// The RECEIVE callback returns QUIC_STATUS_PENDING, so msquic keeps the
+// buffers the iovecs point into until the writer calls StreamReceiveComplete
+// - no copy, and the stream's flow control window holds the peer back while
+// the disk is behind. msquic delivers no further RECEIVE until then, so a
+// transfer has at most one write in flight.
+typedef struct file_write {
+    file_recv* recv;
+    struct file_write* next;    // file_write_queue
+    uint64_t receive_length;    // TotalBufferLength to complete
+    uint64_t offset;            // File offset of the first iovec
+    size_t length;
+    int iov_count;
+    struct iovec iov[];
+} file_write;
+
+// **pwritev KEEPS THE MSQUIC WORKERS OFF THE DISK - ONE WRITER THREAD TAKES THE QUEUE IN ORDER**
+file_write* file_write_queue = NULL;
+file_write** file_write_tail = &file_write_queue;
+pthread_mutex_t file_write_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t file_write_cond = PTHREAD_COND_INITIALIZER;
+
+bool file_recv_open(file_recv* recv) {
+    if (recv->name_len == 0 || strchr(recv->name, '/') != NULL ||
+        strcmp(recv->name, ".") == 0 || strcmp(recv->name, "..") == 0) {
+        printf("[FILE][ERROR] Refusing file name '%s'\n", recv->name);
+        return false;
+    }
+    snprintf(recv->path, sizeof(recv->path), "%s/%s", FILE_RECV_DIR, recv->name);
+    // **O_NOFOLLOW: A SYMLINK PLANTED IN FILE_RECV_DIR MUST NOT REDIRECT THE WRITE**
+    recv->fd = open(recv->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    if (recv->fd < 0) {
+        perror("[FILE][ERROR] open");
+        return false;
+    }
+    // **SIZE THE FILE UP FRONT SO OFFSET WRITES NEVER EXTEND IT PIECEMEAL**
+    if (ftruncate(recv->fd, (off_t)recv->size) < 0) {
+        perror("[FILE][ERROR] ftruncate");
+        return false;
+    }
+    printf("[FILE] Receiving %s (%llu bytes) into %s\n", recv->name, (unsigned long long)recv->size, recv->path);
+    return true;
+}
+
+// **CONSUMES HEADER AND NAME, THEN COLLECTS THE CONTENT PART OF EVERY BUFFER INTO ONE file_write**
+// *write is left NULL when the buffers held no content.
+bool file_recv_feed(file_recv* recv, uint64_t offset, const QUIC_BUFFER* buffers, uint32_t count, file_write** write) {
+    *write = NULL;
+    file_write* w = malloc(sizeof(file_write) + count * sizeof(struct iovec));
+    if (w == NULL) {
+        printf("[FILE][ERROR] Out of memory for a file write\n");
+        return false;
+    }
+    struct iovec* iov = w->iov;
+    int iov_count = 0;
+    uint64_t write_offset = 0;
+    size_t write_len = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t* buf = buffers[i].Buffer;
+        uint64_t len = buffers[i].Length;
+        while (len > 0 && recv->data_offset == 0) {
+            uint64_t n;
+            if (offset < sizeof(file_transfer_header)) {
+                n = sizeof(file_transfer_header) - offset;
+                if (n > len) n = len;
+                memcpy(recv->header_bytes + offset, buf, n);
+                if (offset + n == sizeof(file_transfer_header)) {
+                    file_transfer_header header;
+                    memcpy(&header, recv->header_bytes, sizeof(header));
+                    recv->name_len = ntohl(header.name_len);
+                    recv->size = be64toh(header.size);
+                    if (ntohl(header.magic) != FILE_TRANSFER_MAGIC || recv->name_len > FILE_TRANSFER_MAX_NAME) {
+                        printf("[FILE][ERROR] Bad file transfer header\n");
+                        free(w);
+                        return false;
+                    }
+                }
+            } else {
+                uint64_t name_off = offset - sizeof(file_transfer_header);
+                n = recv->name_len - name_off;
+                if (n > len) n = len;
+                memcpy(recv->name + name_off, buf, n);
+            }
+            buf += n;
+            len -= n;
+            offset += n;
+            if (offset >= sizeof(file_transfer_header) &&
+                offset == sizeof(file_transfer_header) + recv->name_len) {
+                recv->data_offset = offset;
+                if (!file_recv_open(recv)) {
+                    free(w);
+                    return false;
+                }
+            }
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (iov_count == 0) {
+            write_offset = offset - recv->data_offset;
+        }
+        iov[iov_count++] = (struct iovec){.iov_base = (void*)buf, .iov_len = len};
+        write_len += len;
+        offset += len;
+    }
+    if (write_len == 0) {
+        free(w);
+        return true;
+    }
+    if (recv->fd == -1) {
+        free(w);
+        return false;
+    }
+    if (write_offset + write_len > recv->size) {
+        printf("[FILE][ERROR] %s: peer sent more than the announced %llu bytes\n", recv->name,
+               (unsigned long long)recv->size);
+        free(w);
+        return false;
+    }
+    w->recv = recv;
+    w->next = NULL;
+    w->offset = write_offset;
+    w->length = write_len;
+    w->iov_count = iov_count;
+    *write = w;
+    return true;
+}
+
+// **WRITER THREAD ONLY - pwritev MAY STOP SHORT, SO SKIP WHAT WENT OUT AND CONTINUE AT THE NEW OFFSET**
+bool file_recv_write(file_recv* recv, file_write* w) {
+    struct iovec* next = w->iov;
+    int iov_count = w->iov_count;
+    uint64_t write_offset = w->offset;
+    size_t write_len = w->length;
+    while (write_len > 0) {
+        ssize_t n = pwritev(recv->fd, next, iov_count, (off_t)write_offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("[FILE][ERROR] pwritev");
+            return false;
+        }
+        write_offset += n;
+        write_len -= n;
+        recv->written += n;
+        while (iov_count > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            next->iov_base = (uint8_t*)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+void file_recv_discard_locked(file_recv* recv) {
+    if (recv->write != NULL) {
+        recv->discard_requested = true;
+        return;
+    }
+    if (recv->fd != -1) {
+        close(recv->fd);
+        recv->fd = -1;
+        unlink(recv->path);
+        printf("[FILE] Discarded partial %s\n", recv->path);
+    }
+}
+
+// **THE WRITER MAY STILL OWN THE FD - LET IT DISCARD ONCE ITS WRITE IS DONE**
+void file_recv_discard(file_recv* recv) {
+    pthread_mutex_lock(&file_write_lock);
+    file_recv_discard_locked(recv);
+    pthread_mutex_unlock(&file_write_lock);
+}
+
+// **NEVER UNDER file_write_lock - StreamClose FROM THE WRITER WAITS FOR THE WORKER, WHICH MAY BE WAITING FOR THE LOCK**
+void file_recv_free(file_recv* recv) {
+    pthread_mutex_lock(&admission_lock);
+    for (file_recv** link = &file_transfers; *link != NULL; link = &(*link)->next) {
+        if (*link == recv) {
+            *link = recv->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&admission_lock);
+    MsQuic->StreamClose(recv->stream);
+    free(recv);
+}
+
+// **COMPLETES EVERY RECEIVE FROM HERE - StreamReceiveComplete/StreamShutdown ARE QUEUED, SO file_write_lock MAY BE HELD**
+void* file_writer_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&file_write_lock);
+    while (1) {
+        while (file_write_queue == NULL) {
+            pthread_cond_wait(&file_write_cond, &file_write_lock);
+        }
+        file_write* w = file_write_queue;
+        file_write_queue = w->next;
+        if (file_write_queue == NULL) {
+            file_write_tail = &file_write_queue;
+        }
+        file_recv* recv = w->recv;
+        bool ok = true;
+        if (!recv->closed && !recv->discard_requested) {
+            pthread_mutex_unlock(&file_write_lock);
+            ok = file_recv_write(recv, w);
+            pthread_mutex_lock(&file_write_lock);
+        }
+        recv->write = NULL;
+        if (recv->closed) {
+            // **SHUTDOWN_COMPLETE CAME WHILE WE WROTE - THE STREAM IS OURS TO CLOSE**
+            file_recv_discard_locked(recv);
+            pthread_mutex_unlock(&file_write_lock);
+            file_recv_free(recv);
+            pthread_mutex_lock(&file_write_lock);
+        } else {
+            if (!ok || recv->discard_requested) {
+                file_recv_discard_locked(recv);
+            }
+            if (!ok) {
+                MsQuic->StreamShutdown(recv->stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, FILE_TRANSFER_ERROR_REJECTED);
+            }
+            MsQuic->StreamReceiveComplete(recv->stream, w->receive_length);
+        }
+        free(w);
+    }
+    return NULL;
+}
+
+// **THE CLIENT ONLY REPORTS SUCCESS ON THIS BYTE, SO SEND IT AFTER close() SUCCEEDED**
+bool file_recv_confirm(HQUIC Stream, file_recv* recv) {
+    static const uint8_t status_ok = FILE_TRANSFER_STATUS_OK;
+    static const QUIC_BUFFER reply = {.Length = 1, .Buffer = (uint8_t*)&status_ok};
+    int fd = recv->fd;
+    recv->fd = -1;
+    if (close(fd) < 0) {
+        perror("[FILE][ERROR] close");
+        unlink(recv->path);
+        return false;
+    }
+    QUIC_STATUS status = MsQuic->StreamSend(Stream, &reply, 1, QUIC_SEND_FLAG_FIN, NULL);
+    if (QUIC_FAILED(status)) {
+        printf("[FILE][ERROR] Sending the confirmation for %s failed: 0x%x\n", recv->name, status);
+        unlink(recv->path);
+        return false;
+    }
+    recv->complete = true;
+    return true;
+}
+
+QUIC_STATUS QUIC_API FileReceiveStreamCallback(HQUIC Stream, void* Context, QUIC_STREAM_EVENT* Event) {
+    file_recv* recv = Context;
+    switch (Event->Type) {
+        case QUIC_STREAM_EVENT_RECEIVE: {
+            file_write* write;
+            if (!file_recv_feed(recv, Event->RECEIVE.AbsoluteOffset, Event->RECEIVE.Buffers, Event->RECEIVE.BufferCount, &write)) {
+                file_recv_discard(recv);
+                MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, FILE_TRANSFER_ERROR_REJECTED);
+            } else if (write != NULL) {
+                // **HANDED TO file_writer_thread, WHICH CALLS StreamReceiveComplete**
+                write->receive_length = Event->RECEIVE.TotalBufferLength;
+                pthread_mutex_lock(&file_write_lock);
+                recv->write = write;
+                *file_write_tail = write;
+                file_write_tail = &write->next;
+                pthread_cond_signal(&file_write_cond);
+                pthread_mutex_unlock(&file_write_lock);
+                return QUIC_STATUS_PENDING;
+            }
+            MsQuic->StreamReceiveComplete(Stream, Event->RECEIVE.TotalBufferLength);
+            break;
+        }
+        case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
+            if (recv->fd != -1 && recv->written == recv->size) {
+                if (file_recv_confirm(Stream, recv)) {
+                    printf("[FILE] Received %s (%llu bytes).\n", recv->path, (unsigned long long)recv->size);
+                } else {
+                    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, FILE_TRANSFER_ERROR_REJECTED);
+                }
+            } else {
+                printf("[FILE][ERROR] Stream for %s ended after %llu of %llu bytes\n", recv->name,
+                       (unsigned long long)recv->written, (unsigned long long)recv->size);
+                file_recv_discard(recv);
+                MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, FILE_TRANSFER_ERROR_REJECTED);
+            }
+            break;
+        case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+            printf("[FILE][WARNING] Peer aborted the transfer of %s\n", recv->name);
+            file_recv_discard(recv);
+            MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT_SEND, FILE_TRANSFER_ERROR_REJECTED);
+            break;
+        case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+            pthread_mutex_lock(&file_write_lock);
+            // **A WRITE IS STILL IN FLIGHT - file_writer_thread CLOSES THE STREAM WHEN IT IS DONE**
+            bool ours = recv->write == NULL;
+            if (ours) {
+                file_recv_discard_locked(recv);
+            } else {
+                recv->closed = true;
+            }
+            pthread_mutex_unlock(&file_write_lock);
+            if (ours) {
+                file_recv_free(recv);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+bool file_transfers_active() {
+    pthread_mutex_lock(&admission_lock);
+    bool active = file_transfers != NULL;
+    pthread_mutex_unlock(&admission_lock);
+    return active;
+}
+
+// **RELAY BACKLOG TOWARD THE BACKEND - THE ONE BUFFER THAT GROWS WHEN WE ARE OVERLOADED**
+// Only meaningful while a backend is attached: without one, pending_data just
+// waits for the next accept() and would otherwise keep us refusing forever.
+// The hysteresis state is under admission_lock; the relay fields it samples
+// are written by the main loop and the workers, so they are read atomically.
+bool relay_overloaded = false;
+
+bool admission_overloaded_locked() {
+    size_t backlog = __atomic_load_n(&pending_data_len, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&tcp_client, __ATOMIC_RELAXED) == -1) {
+        relay_overloaded = false;
+    } else if (backlog > BUFFERED_BYTES_HIGH_WATERMARK) {
+        relay_overloaded = true;
+    } else if (backlog < BUFFERED_BYTES_LOW_WATERMARK) {
+        relay_overloaded = false;
+    }
+    return relay_overloaded;
+}
+
+bool admission_overloaded() {
+    pthread_mutex_lock(&admission_lock);
+    bool overloaded = admission_overloaded_locked();
+    pthread_mutex_unlock(&admission_lock);
+    return overloaded;
+}
+
+// **TAKES A CONNECTION SLOT, OR RETURNS FALSE IF THE NEW CONNECTION MUST BE REFUSED**
+bool admission_admit(HQUIC Connection) {
+    bool admitted = false;
+    pthread_mutex_lock(&admission_lock);
+    if (active_connection_count >= MAX_ACTIVE_CONNECTIONS) {
+        printf("[ADMIT] Refusing connection %p: %d connections active (max %d).\n",
+               (void*)Connection, active_connection_count, MAX_ACTIVE_CONNECTIONS);
+    } else if (admission_overloaded_locked()) {
+        printf("[ADMIT] Refusing connection %p: relay backlog %zu bytes (overloaded above %d until below %d).\n",
+               (void*)Connection, pending_data_len, BUFFERED_BYTES_HIGH_WATERMARK, BUFFERED_BYTES_LOW_WATERMARK);
+    } else {
+        active_connections[active_connection_count] = Connection;
+        active_connection_shed[active_connection_count] = false;
+        active_connection_count++;
+        admitted = true;
+    }
+    pthread_mutex_unlock(&admission_lock);
+    return admitted;
+}
+
+void admission_release(HQUIC Connection) {
+    pthread_mutex_lock(&admission_lock);
+    for (int i = 0; i < active_connection_count; ++i) {
+        if (active_connections[i] == Connection) {
+            active_connection_count--;
+            active_connections[i] = active_connections[active_connection_count];
+            active_connection_shed[i] = active_connection_shed[active_connection_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+// **CALLED FROM THE MAIN LOOP EVERY SHED_CHECK_INTERVAL_MS - SHEDS ONE PRIORITY CLASS PER CHECK**
+// Shutdowns are only queued to the msquic workers, so issuing them under
+// admission_lock is safe and keeps the handles from being closed meanwhile.
+void shed_load() {
+    pthread_mutex_lock(&admission_lock);
+    if (!admission_overloaded_locked()) {
+        pthread_mutex_unlock(&admission_lock);
+        return;
+    }
+    int shed = 0;
+    for (file_recv* recv = file_transfers; recv != NULL; recv = recv->next) {
+        if (!recv->shed && !recv->complete) {
+            recv->shed = true;
+            MsQuic->StreamShutdown(recv->stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, FILE_TRANSFER_ERROR_SHED);
+            shed++;
+        }
+    }
+    if (shed > 0) {
+        printf("[SHED] Relay backlog %zu bytes: aborted %d file transfers.\n", pending_data_len, shed);
+        pthread_mutex_unlock(&admission_lock);
+        return;
+    }
+    for (int i = 0; i < active_connection_count; ++i) {
+        if (active_connections[i] != CurrentConnection && !active_connection_shed[i]) {
+            active_connection_shed[i] = true;
+            MsQuic->ConnectionShutdown(active_connections[i], QUIC_CONNECTION_SHUTDOWN_FLAG_NONE, 0);
+            shed++;
+        }
+    }
+    pthread_mutex_unlock(&admission_lock);
+    if (shed > 0) {
+        printf("[SHED] Relay backlog %zu bytes: shut down %d connections not carrying the relay.\n",
+               pending_data_len, shed);
+    } else {
+        printf("[SHED] Relay backlog %zu bytes, nothing left to shed but the relay itself.\n", pending_data_len);
+    }
+}
+
+// **CLIENT IS BLOCKED ON STREAM CREDIT (E.G. REFILLING ITS STREAM POOL) - RAISE ITS LIMIT**
+void grant_peer_stream_credit(HQUIC Connection) {
+    QUIC_SETTINGS current = {0};
+    uint32_t size = sizeof(current);
+    QUIC_STATUS status = MsQuic->GetParam(Connection, QUIC_PARAM_CONN_SETTINGS, &size, &current);
+    if (QUIC_FAILED(status)) {
+        printf("[QUIC][ERROR] Reading connection settings failed: 0x%x\n", status);
+        return;
+    }
+    if (admission_overloaded()) {
+        printf("[ADMIT] Overloaded, holding peer bidi stream credit at %u.\n", current.PeerBidiStreamCount);
+        return;
+    }
+    if (current.PeerBidiStreamCount >= MAX_PEER_BIDI_STREAMS) {
+        printf("[QUIC][WARNING] Peer already at MAX_PEER_BIDI_STREAMS (%u), not granting more.\n",
+               current.PeerBidiStreamCount);
+        return;
+    }
+    uint32_t granted = current.PeerBidiStreamCount + PEER_BIDI_STREAM_STEP;
+    if (granted > MAX_PEER_BIDI_STREAMS) granted = MAX_PEER_BIDI_STREAMS;
+
+    QUIC_SETTINGS update = {0};
+    update.PeerBidiStreamCount = (uint16_t)granted;
+    update.IsSet.PeerBidiStreamCount = TRUE;
+    status = MsQuic->SetParam(Connection, QUIC_PARAM_CONN_SETTINGS, sizeof(update), &update);
+    if (QUIC_FAILED(status)) {
+        printf("[QUIC][ERROR] Raising peer stream credit failed: 0x%x\n", status);
+        return;
+    }
+    printf("[QUIC] Raised peer bidi stream credit %u -> %u.\n", current.PeerBidiStreamCount, granted);
+}
+
 QUIC_STATUS QUIC_API ServerConnectionCallback(HQUIC Connection, void* Context, QUIC_CONNECTION_EVENT* Event) {
     printf("[QUIC][DEBUG] ========== CONNECTION CALLBACK START ==========\n");
     printf("[QUIC][DEBUG] Connection callback: Connection=%p, Event->Type=%d\n", (void*)Connection, Event->Type);
@@ -252,19 +995,31 @@ QUIC_STATUS QUIC_API ServerConnectionCallback(HQUIC Connection, void* Context, Q
             printf("[QUIC][DEBUG] *** CONNECTED EVENT ***\n");
             printf("[QUIC] Connection established (client handshake complete).\n");
             printf("[QUIC] Connection is stable and ready for streams.\n");
-            CurrentConnection = Connection;
-            printf("[QUIC][DEBUG] Set CurrentConnection to %p\n", (void*)CurrentConnection);
+            // **ONLY ADOPT IT WHEN IDLE - STANDBY CONNECTIONS MUST NOT TAKE OVER A LIVE RELAY**
+            pthread_mutex_lock(&session_lock);
+            if (CurrentConnection == NULL) {
+                CurrentConnection = Connection;
+                printf("[QUIC][DEBUG] Set CurrentConnection to %p\n", (void*)CurrentConnection);
+            }
+            pthread_mutex_unlock(&session_lock);
             break;
             
         case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
             printf("[QUIC][CRITICAL] *** SHUTDOWN_COMPLETE EVENT ***\n");
             printf("[QUIC][CRITICAL] Connection shutdown complete! Connection is being destroyed.\n");
+            pthread_mutex_lock(&session_lock);
             if (Connection == CurrentConnection) {
                 printf("[QUIC][CRITICAL] Our active connection is being destroyed!\n");
                 CurrentConnection = NULL;
-                QuicStream = NULL;
-                printf("[QUIC][DEBUG] Cleared CurrentConnection and QuicStream\n");
+                pick_session_stream_locked();
+                printf("[QUIC][DEBUG] Relay moved to connection %p, stream %p\n",
+                       (void*)CurrentConnection, (void*)QuicStream);
             }
+            if (Connection == session_connection) {
+                session_connection = NULL;
+            }
+            pthread_mutex_unlock(&session_lock);
+            admission_release(Connection);
             MsQuic->ConnectionClose(Connection);
             break;
             
@@ -274,11 +1029,29 @@ QUIC_STATUS QUIC_API ServerConnectionCallback(HQUIC Connection, void* Context, Q
             printf("[QUIC][DEBUG] New stream: %p (previous stream: %p)\n", 
                    Event->PEER_STREAM_STARTED.Stream, (void*)QuicStream);
             
-            // **ALWAYS UPDATE TO THE NEW STREAM**
-            QuicStream = Event->PEER_STREAM_STARTED.Stream;
+            // **TRACKED IN relay_streams - THE RELAY POINTS AT IT WHEN IT IS THE NEXT SESSION (SEE pick_session_stream_locked)**
+            relay_stream* rs = calloc(1, sizeof(*rs));
+            if (rs == NULL) {
+                fprintf(stderr, "[QUIC][ERROR] Out of memory for stream state\n");
+                exit(1);
+            }
+            rs->stream = Event->PEER_STREAM_STARTED.Stream;
+            rs->connection = Connection;
+            uint32_t id_size = sizeof(rs->id);
+            if (QUIC_FAILED(MsQuic->GetParam(Event->PEER_STREAM_STARTED.Stream, QUIC_PARAM_STREAM_ID, &id_size, &rs->id))) {
+                printf("[QUIC][ERROR] Reading stream ID failed\n");
+            }
             // **SetCallbackHandler returns void - no status check needed**
-            MsQuic->SetCallbackHandler(Event->PEER_STREAM_STARTED.Stream, (void*)ServerStreamCallback, NULL);
-            printf("[QUIC] Stream callback handler set successfully for stream %p\n", (void*)QuicStream);
+            MsQuic->SetCallbackHandler(Event->PEER_STREAM_STARTED.Stream, (void*)ServerStreamCallback, rs);
+            pthread_mutex_lock(&session_lock);
+            rs->next = relay_streams;
+            relay_streams = rs;
+            if (QuicStream == NULL) {
+                pick_session_stream_locked();
+            }
+            pthread_mutex_unlock(&session_lock);
+            printf("[QUIC] Stream callback handler set successfully for stream %p (id %llu)\n",
+                   Event->PEER_STREAM_STARTED.Stream, (unsigned long long)rs->id);
             break;
             
         case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
@@ -299,11 +1072,21 @@ QUIC_STATUS QUIC_API ServerConnectionCallback(HQUIC Connection, void* Context, Q
         case QUIC_CONNECTION_EVENT_PEER_NEEDS_STREAMS:
             printf("[QUIC][DEBUG] *** PEER_NEEDS_STREAMS EVENT ***\n");
             printf("[QUIC] Peer needs streams event.\n");
+            if (Event->PEER_NEEDS_STREAMS.Bidirectional) {
+                grant_peer_stream_credit(Connection);
+            }
             break;
             
         case QUIC_CONNECTION_EVENT_IDEAL_PROCESSOR_CHANGED:
             printf("[QUIC][DEBUG] *** IDEAL_PROCESSOR_CHANGED EVENT ***\n");
-            printf("[QUIC] Ideal processor changed event.\n");
+            printf("[QUIC] Ideal processor changed event: processor=%u, partition=%u.\n",
+                   Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor,
+                   Event->IDEAL_PROCESSOR_CHANGED.PartitionIndex);
+#if RELAY_FOLLOW_IDEAL_PROCESSOR
+            if (CurrentConnection == NULL || Connection == CurrentConnection) {
+                relay_placement_request(Event->IDEAL_PROCESSOR_CHANGED.IdealProcessor);
+            }
+#endif
             break;
             
         case QUIC_CONNECTION_EVENT_DATAGRAM_STATE_CHANGED:
@@ -319,6 +1102,44 @@ QUIC_STATUS QUIC_API ServerConnectionCallback(HQUIC Connection, void* Context, Q
     return QUIC_STATUS_SUCCESS;
 }
 
+// **CONNECTIONS NEGOTIATED WITH FILE_TRANSFER_ALPN - EVERY STREAM IS A FILE, NONE TOUCHES THE RELAY**
+QUIC_STATUS QUIC_API FileConnectionCallback(HQUIC Connection, void* Context, QUIC_CONNECTION_EVENT* Event) {
+    switch (Event->Type) {
+        case QUIC_CONNECTION_EVENT_CONNECTED:
+            printf("[FILE] File transfer connection %p established.\n", (void*)Connection);
+            break;
+        case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+            printf("[FILE] File transfer connection %p shutdown complete.\n", (void*)Connection);
+            admission_release(Connection);
+            MsQuic->ConnectionClose(Connection);
+            break;
+        case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED: {
+            file_recv* recv = calloc(1, sizeof(*recv));
+            if (recv == NULL) {
+                MsQuic->StreamClose(Event->PEER_STREAM_STARTED.Stream);
+                break;
+            }
+            recv->fd = -1;
+            recv->stream = Event->PEER_STREAM_STARTED.Stream;
+            pthread_mutex_lock(&admission_lock);
+            recv->next = file_transfers;
+            file_transfers = recv;
+            pthread_mutex_unlock(&admission_lock);
+            MsQuic->SetCallbackHandler(Event->PEER_STREAM_STARTED.Stream, (void*)FileReceiveStreamCallback, recv);
+            printf("[FILE] Incoming file transfer on stream %p\n", Event->PEER_STREAM_STARTED.Stream);
+            break;
+        }
+        case QUIC_CONNECTION_EVENT_PEER_NEEDS_STREAMS:
+            if (Event->PEER_NEEDS_STREAMS.Bidirectional) {
+                grant_peer_stream_credit(Connection);
+            }
+            break;
+        default:
+            break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
 QUIC_STATUS QUIC_API ServerListenerCallback(HQUIC Listener, void* Context, QUIC_LISTENER_EVENT* Event) {
     printf("[QUIC][DEBUG] ========== LISTENER CALLBACK START ==========\n");
     printf("[QUIC] Listener event type: %d\n", Event->Type);
@@ -328,18 +1149,32 @@ QUIC_STATUS QUIC_API ServerListenerCallback(HQUIC Listener, void* Context, QUIC_
             printf("[QUIC] New QUIC connection received. Setting configuration and callback handler.\n");
             printf("[QUIC][DEBUG] New connection: %p\n", Event->NEW_CONNECTION.Connection);
             
+            // **ADMISSION CONTROL - A FAILURE STATUS MAKES MSQUIC REJECT THE HANDSHAKE**
+            if (!admission_admit(Event->NEW_CONNECTION.Connection)) {
+                printf("[QUIC][DEBUG] ========== LISTENER CALLBACK END ==========\n");
+                return QUIC_STATUS_CONNECTION_REFUSED;
+            }
+            
+            const QUIC_NEW_CONNECTION_INFO* info = Event->NEW_CONNECTION.Info;
+            bool file_connection = info->NegotiatedAlpnLength == sizeof(FILE_TRANSFER_ALPN) - 1 &&
+                memcmp(info->NegotiatedAlpn, FILE_TRANSFER_ALPN, info->NegotiatedAlpnLength) == 0;
             // **SetCallbackHandler returns void - no status check needed**
-            MsQuic->SetCallbackHandler(Event->NEW_CONNECTION.Connection, (void*)ServerConnectionCallback, NULL);
-            printf("[QUIC] Connection callback handler set successfully.\n");
+            MsQuic->SetCallbackHandler(Event->NEW_CONNECTION.Connection,
+                                       file_connection ? (void*)FileConnectionCallback : (void*)ServerConnectionCallback, NULL);
+            printf("[QUIC] %s connection callback handler set successfully.\n", file_connection ? "File transfer" : "Relay");
             
             QUIC_STATUS status = MsQuic->ConnectionSetConfiguration(Event->NEW_CONNECTION.Connection, Configuration);
             if (QUIC_FAILED(status)) {
                 printf("[QUIC][ERROR] Failed to set connection configuration: 0x%x\n", status);
+                admission_release(Event->NEW_CONNECTION.Connection);
             } else {
                 printf("[QUIC] Connection configuration set successfully.\n");
             }
             printf("[QUIC][DEBUG] ========== LISTENER CALLBACK END ==========\n");
             return status;
+        case QUIC_LISTENER_EVENT_STOP_COMPLETE:
+            printf("[QUIC] Listener stopped; no new connections will be accepted.\n");
+            break;
         default:
             printf("[QUIC][WARNING] *** UNHANDLED LISTENER EVENT %d ***\n", Event->Type);
             break;
@@ -354,7 +1189,23 @@ void msquic_init() {
         fprintf(stderr, "[QUIC][ERROR] MsQuicOpen2 failed\n");
         exit(1);
     }
-    QUIC_BUFFER alpn = {4, (uint8_t*)"chow"};
+    // **RELAY AND FILE TRANSFER CONNECTIONS ARE TOLD APART BY ALPN**
+    QUIC_BUFFER alpn[2] = {
+        {4, (uint8_t*)"chow"},
+        {sizeof(FILE_TRANSFER_ALPN) - 1, (uint8_t*)FILE_TRANSFER_ALPN}
+    };
+
+    apply_worker_cpu_config();
+
+    // **WORKER QUEUE DELAY IS LIBRARY-WIDE - SET IT GLOBALLY, BEFORE THE REGISTRATION EXISTS**
+    QUIC_SETTINGS global = {0};
+    global.MaxWorkerQueueDelayUs = MAX_WORKER_QUEUE_DELAY_US; // msquic refuses handshakes beyond this
+    global.IsSet.MaxWorkerQueueDelayUs = TRUE;
+    QUIC_STATUS status = MsQuic->SetParam(NULL, QUIC_PARAM_GLOBAL_SETTINGS, sizeof(global), &global);
+    if (QUIC_FAILED(status)) {
+        fprintf(stderr, "[QUIC][ERROR] Setting QUIC_PARAM_GLOBAL_SETTINGS failed: 0x%x\n", status);
+        exit(1);
+    }
 
     printf("[QUIC] Opening registration context...\n");
     if (QUIC_FAILED(MsQuic->RegistrationOpen(NULL, &Registration))) {
@@ -364,15 +1215,13 @@ void msquic_init() {
 
     // **CORRECT FLOW CONTROL SETTINGS FOR YOUR MSQUIC VERSION**
     QUIC_SETTINGS Settings = {0};
-    Settings.PeerBidiStreamCount = 10;              // Allow 10 bidirectional streams from peer
-    Settings.PeerUnidiStreamCount = 10;             // Allow 10 unidirectional streams from peer
+    Settings.PeerBidiStreamCount = PEER_BIDI_STREAM_COUNT; // Initial bidi streams from peer, grown on demand
     Settings.ConnFlowControlWindow = 16777216;      // 16MB connection flow control window
     Settings.StreamRecvWindowDefault = 1048576;     // 1MB per-stream receive window (correct name)
     Settings.MaxBytesPerKey = 274877906944ULL;      // Large key update threshold
     Settings.ServerResumptionLevel = QUIC_SERVER_RESUME_AND_ZERORTT;
     Settings.IdleTimeoutMs = 60000;                 // 60 second idle timeout
     Settings.IsSet.PeerBidiStreamCount = TRUE;
-    Settings.IsSet.PeerUnidiStreamCount = TRUE;
     Settings.IsSet.ConnFlowControlWindow = TRUE;
     Settings.IsSet.StreamRecvWindowDefault = TRUE;  // Correct IsSet name
     Settings.IsSet.MaxBytesPerKey = TRUE;
@@ -382,7 +1231,7 @@ void msquic_init() {
     printf("[QUIC] Opening configuration context...\n");
     if (QUIC_FAILED(MsQuic->ConfigurationOpen(
             Registration,
-            &alpn, 1,
+            alpn, 2,
             &Settings, sizeof(Settings),
             NULL,
             &Configuration))) {
@@ -418,6 +1267,9 @@ void try_flush_pending_data() {
         
         if (nwritten > 0) {
             printf("[RELAY] Flushed %zd buffered bytes to TCP client.\n", nwritten);
+#if TRAFFIC_CAPTURE
+            capture_event(CAPTURE_EVENT_TCP_WRITE, capture_session, pending_data, (uint32_t)nwritten);
+#endif
             if ((size_t)nwritten == pending_data_len) {
                 pending_data_len = 0; // All data sent
             } else {
@@ -435,6 +1287,23 @@ void try_flush_pending_data() {
 
 int main() {
     printf("[INIT] Starting QUIC relay server...\n");
+    install_drain_handler();
+    pthread_t file_writer;
+    if (pthread_create(&file_writer, NULL, file_writer_thread, NULL) != 0) {
+        perror("[FILE][ERROR] pthread_create");
+        exit(1);
+    }
+    pthread_detach(file_writer);
+#if LATENCY_TRACE
+    latency_trace_init();
+#endif
+#if TRAFFIC_CAPTURE
+    capture_open(CAPTURE_PATH);
+#endif
+    if (mkdir(FILE_RECV_DIR, 0755) < 0 && errno != EEXIST) {
+        perror("[FILE][ERROR] mkdir " FILE_RECV_DIR);
+        exit(1);
+    }
     msquic_init();
 
     printf("[QUIC] Opening listener for new incoming connections...\n");
@@ -442,27 +1311,68 @@ int main() {
         fprintf(stderr, "[QUIC][ERROR] ListenerOpen failed\n");
         exit(1);
     }
-    
+
     // **SIMPLE ADDRESS SETUP:**
     QUIC_ADDR addr = {0};
-    QuicAddrFromString(SERVER_IP, QUIC_PORT, &addr);  // **USE QuicAddrFromString HELPER**
+    if (SERVER_IP[0] == '\0') {
+        // **UNSPEC WILDCARD = DUAL-STACK, SO CLIENTS RACING OVER IPV4 AND IPV6 CAN BOTH CONNECT**
+        QuicAddrSetFamily(&addr, QUIC_ADDRESS_FAMILY_UNSPEC);
+        QuicAddrSetPort(&addr, QUIC_PORT);
+    } else {
+        QuicAddrFromString(SERVER_IP, QUIC_PORT, &addr);  // **USE QuicAddrFromString HELPER**
+    }
     
-    QUIC_BUFFER alpn = {4, (uint8_t*)"chow"};
-    printf("[QUIC] Starting QUIC listener on %s:%d...\n", SERVER_IP, QUIC_PORT);
-    if (QUIC_FAILED(MsQuic->ListenerStart(Listener, &alpn, 1, &addr))) {
+    QUIC_BUFFER alpn[2] = {
+        {4, (uint8_t*)"chow"},
+        {sizeof(FILE_TRANSFER_ALPN) - 1, (uint8_t*)FILE_TRANSFER_ALPN}
+    };
+    printf("[QUIC] Starting QUIC listener on %s:%d...\n", SERVER_IP[0] ? SERVER_IP : "[::]+0.0.0.0", QUIC_PORT);
+    if (QUIC_FAILED(MsQuic->ListenerStart(Listener, alpn, 2, &addr))) {
         fprintf(stderr, "[QUIC][ERROR] ListenerStart failed\n");
         exit(1);
     }
     printf("[QUIC] Listener running: waiting for incoming QUIC connections.\n");
 
-    tcp_server = setup_local_tcp_server(LOCAL_TCP_PORT);
+    tcp_server = setup_local_server();
 
     fd_set rfds, wfds;
     int maxfd;
+#if LATENCY_TRACE
+    char frame[LATENCY_HEADER_ROOM + BUFFER_SIZE]; // The chunk header is framed in front of the payload
+    char* data = frame + LATENCY_HEADER_ROOM;
+#else
     char data[BUFFER_SIZE];
-    printf("[MAIN] Ready: Accepting TCP on 127.0.0.1:%d, QUIC on port %d\n", LOCAL_TCP_PORT, QUIC_PORT);
+#endif
+    bool draining = false;
+    uint64_t drain_deadline = 0;
+    uint64_t next_shed_check = monotonic_ms() + SHED_CHECK_INTERVAL_MS;
+    if (local_is_unix) {
+        printf("[MAIN] Ready: Accepting AF_UNIX on %s, QUIC on port %d\n", LOCAL_UNIX_PATH, QUIC_PORT);
+    } else {
+        printf("[MAIN] Ready: Accepting TCP on 127.0.0.1:%d, QUIC on port %d\n", LOCAL_TCP_PORT, QUIC_PORT);
+    }
 
     while (1) {
+        // **DRAIN: STOP ACCEPTING, LET THE RELAY AND FILE TRANSFERS FINISH, THEN EXIT**
+        // Idle connections (client standbys, finished file connections) are closed by msquic_cleanup().
+        if (drain_requested && !draining) {
+            printf("[DRAIN] Drain requested: stopping listener, waiting up to %d ms for the relay and file transfers.\n",
+                   DRAIN_TIMEOUT_MS);
+            draining = true;
+            drain_deadline = monotonic_ms() + DRAIN_TIMEOUT_MS;
+            MsQuic->ListenerStop(Listener);
+        }
+        if (draining) {
+            if (CurrentConnection == NULL && !file_transfers_active()) {
+                printf("[DRAIN] No active relay or file transfer left, exiting.\n");
+                break;
+            }
+            if (monotonic_ms() >= drain_deadline) {
+                printf("[DRAIN] Drain timeout reached, shutting down all connections.\n");
+                break;
+            }
+        }
+
         FD_ZERO(&rfds);
         FD_ZERO(&wfds);
         FD_SET(tcp_server, &rfds);
@@ -479,11 +1389,26 @@ int main() {
                tcp_server, tcp_client, pending_data_len);
         
         // **USE SELECT WITH BOTH READ AND WRITE SETS**
-        int ready = select(maxfd + 1, &rfds, &wfds, NULL, NULL);
+        // **WAKE UP AT LEAST EVERY SHED_CHECK_INTERVAL_MS FOR THE LOAD SHEDDER AND THE DRAIN DEADLINE**
+        struct timeval tick = {SHED_CHECK_INTERVAL_MS / 1000, (SHED_CHECK_INTERVAL_MS % 1000) * 1000};
+        int ready = select(maxfd + 1, &rfds, &wfds, NULL, &tick);
+#if LATENCY_TRACE
+        latency_trace_poll();
+#endif
+#if RELAY_FOLLOW_IDEAL_PROCESSOR
+        relay_placement_poll();
+#endif
         if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("[MAIN][ERROR] select");
             break;
         }
+        if (monotonic_ms() >= next_shed_check) {
+            shed_load();
+            next_shed_check = monotonic_ms() + SHED_CHECK_INTERVAL_MS;
+        }
         
         printf("[MAIN][DEBUG] select() returned %d ready descriptors\n", ready);
         
@@ -503,16 +1428,21 @@ int main() {
                     tcp_client = -1;
                 } else {
                     printf("[TCP] Accepted new local TCP client (fd=%d).\n", tcp_client);
+#if TRAFFIC_CAPTURE
+                    capture_event(CAPTURE_EVENT_SESSION_OPEN, ++capture_session, NULL, 0);
+#endif
                     
                     // **SET TCP CLIENT TO NON-BLOCKING MODE**
                     int flags = fcntl(tcp_client, F_GETFL, 0);
                     fcntl(tcp_client, F_SETFL, flags | O_NONBLOCK);
                     printf("[TCP][DEBUG] Set tcp_client to non-blocking mode\n");
                     
-                    // **SET TCP_NODELAY**
-                    int opt = 1;
-                    setsockopt(tcp_client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
-                    printf("[TCP][DEBUG] Set TCP_NODELAY on tcp_client\n");
+                    // **SET TCP_NODELAY (NOT APPLICABLE TO AF_UNIX)**
+                    if (!local_is_unix) {
+                        int opt = 1;
+                        setsockopt(tcp_client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                        printf("[TCP][DEBUG] Set TCP_NODELAY on tcp_client\n");
+                    }
                     
                     // **DELIVER BUFFERED DATA**
                     try_flush_pending_data();
@@ -528,18 +1458,36 @@ int main() {
         // Read from local TCP client and send to QUIC stream
         if (tcp_client != -1 && FD_ISSET(tcp_client, &rfds)) {
             printf("[MAIN][DEBUG] TCP client has data to read\n");
-            ssize_t nread = read(tcp_client, data, sizeof(data));
+            ssize_t nread = read(tcp_client, data, BUFFER_SIZE);
             printf("[MAIN][DEBUG] read() returned %zd bytes from tcp_client\n", nread);
             
             if (nread > 0) {
+#if LATENCY_TRACE
+                uint64_t t_read = latency_now_ns();
+#endif
+#if TRAFFIC_CAPTURE
+                capture_event(CAPTURE_EVENT_TCP_READ, capture_session, data, (uint32_t)nread);
+#endif
                 printf("[RELAY] Read %zd bytes from TCP client\n", nread);
                 printf("[RELAY][DEBUG] Current QuicStream=%p, CurrentConnection=%p\n", 
                        (void*)QuicStream, (void*)CurrentConnection);
                 
+                // **HELD ACROSS StreamSend - THE WORKERS MUST NOT CLOSE QuicStream UNDER US**
+                pthread_mutex_lock(&session_lock);
                 if (QuicStream && CurrentConnection) {
                     printf("[RELAY] Relaying to QUIC peer...\n");
+#if LATENCY_TRACE
+                    latency_send_ctx* trace;
+                    QUIC_BUFFER buf;
+                    buf.Buffer = latency_send_frame((uint8_t*)data, (uint32_t)nread, t_read, &buf.Length, &trace);
+                    QUIC_STATUS qs = MsQuic->StreamSend(QuicStream, &buf, 1, QUIC_SEND_FLAG_NONE, trace);
+                    if (QUIC_FAILED(qs)) {
+                        free(trace);
+                    }
+#else
                     QUIC_BUFFER buf = {.Length = (uint32_t)nread, .Buffer = (uint8_t*)data};
                     QUIC_STATUS qs = MsQuic->StreamSend(QuicStream, &buf, 1, QUIC_SEND_FLAG_NONE, NULL);
+#endif
                     if (QUIC_FAILED(qs)) {
                         fprintf(stderr, "[QUIC][ERROR] StreamSend failed (status=0x%x)\n", qs);
                     } else {
@@ -549,6 +1497,7 @@ int main() {
                     printf("[RELAY][WARN] No QUIC stream available (QuicStream=%p, CurrentConnection=%p), data dropped.\n", 
                            (void*)QuicStream, (void*)CurrentConnection);
                 }
+                pthread_mutex_unlock(&session_lock);
             } else if (nread == 0) {
                 printf("[TCP] TCP client disconnected (EOF).\n");
                 close_tcp_client();
@@ -566,6 +1515,10 @@ int main() {
     msquic_cleanup();
     if (tcp_server != -1) close(tcp_server);
     if (tcp_client != -1) close(tcp_client);
+    if (local_is_unix) unlink(LOCAL_UNIX_PATH);
+#if TRAFFIC_CAPTURE
+    capture_close();
+#endif
     printf("[EXIT] QUIC relay server exiting.\n");
     return 0;
 }
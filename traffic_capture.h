@@ -0,0 +1,187 @@
+// Relay traffic capture: trace format shared by quic_client.c, quic_server.c
+// and quic_replay.c, plus the writer used by the two relays.
+//
+// Build a relay with -DTRAFFIC_CAPTURE=1 to record every chunk that crosses
+// its local TCP read and write paths, plus session open/close, into
+// CAPTURE_PATH. Add -DCAPTURE_PAYLOADS=1 to store the bytes as well; by
+// default only sizes and timing are kept. The file is memory-mapped and
+// appended to in CAPTURE_GROW_BYTES steps; the header's data_end is
+// published after every record, so a trace from a killed relay is still
+// readable up to its last complete record.
+//
+// Layout (host byte order):
+//   capture_file_header
+//   capture_record [payload padded to 8 bytes, only with CAPTURE_FLAG_PAYLOADS
+//                   and only for TCP_READ/TCP_WRITE records]
+//   capture_record ...
+
+#pragma once
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "QRTRACE1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FLAG_PAYLOADS 0x1
+
+#define CAPTURE_EVENT_TCP_READ 0       // Local TCP peer -> QUIC (relay read path)
+#define CAPTURE_EVENT_TCP_WRITE 1      // QUIC -> local TCP peer (relay write path)
+#define CAPTURE_EVENT_SESSION_OPEN 2   // Local TCP peer accepted
+#define CAPTURE_EVENT_SESSION_CLOSE 3  // Local TCP peer closed
+
+typedef struct capture_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t start_realtime_ns;  // Wall-clock time of the first record's t_ns == 0
+    uint64_t data_end;           // Bytes of complete records following this header
+} capture_file_header;
+
+typedef struct capture_record {
+    uint64_t t_ns;      // Monotonic nanoseconds since the capture started
+    uint32_t length;    // Chunk size in bytes, 0 for session events
+    uint16_t session;   // Local TCP session the chunk belongs to
+    uint8_t event;      // CAPTURE_EVENT_*
+    uint8_t reserved;
+} capture_record;
+
+static inline uint64_t capture_payload_bytes(const capture_file_header* header, const capture_record* rec) {
+    if (!(header->flags & CAPTURE_FLAG_PAYLOADS) ||
+        (rec->event != CAPTURE_EVENT_TCP_READ && rec->event != CAPTURE_EVENT_TCP_WRITE)) {
+        return 0;
+    }
+    return ((uint64_t)rec->length + 7) & ~(uint64_t)7;
+}
+
+#ifndef TRAFFIC_CAPTURE
+#define TRAFFIC_CAPTURE 0
+#endif
+
+#if TRAFFIC_CAPTURE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#ifndef CAPTURE_PATH
+#define CAPTURE_PATH "relay_capture.trc"
+#endif
+#ifndef CAPTURE_PAYLOADS
+#define CAPTURE_PAYLOADS 0
+#endif
+#define CAPTURE_GROW_BYTES (64u << 20)
+
+static int capture_fd = -1;
+static uint8_t* capture_map = NULL;
+static size_t capture_map_size = 0;
+static uint64_t capture_start_ns = 0;
+static uint16_t capture_session = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t capture_monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline bool capture_grow(size_t needed) {
+    size_t new_size = capture_map_size;
+    while (new_size < needed) {
+        new_size += CAPTURE_GROW_BYTES;
+    }
+    if (ftruncate(capture_fd, (off_t)new_size) < 0) {
+        perror("[CAPTURE][ERROR] ftruncate");
+        return false;
+    }
+    if (capture_map != NULL) {
+        munmap(capture_map, capture_map_size);
+    }
+    void* map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("[CAPTURE][ERROR] mmap");
+        capture_map = NULL;
+        capture_map_size = 0;
+        return false;
+    }
+    capture_map = map;
+    capture_map_size = new_size;
+    return true;
+}
+
+static inline void capture_open(const char* path) {
+    capture_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (capture_fd < 0) {
+        perror("[CAPTURE][ERROR] open");
+        return;
+    }
+    if (!capture_grow(sizeof(capture_file_header))) {
+        close(capture_fd);
+        capture_fd = -1;
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    capture_file_header* header = (capture_file_header*)capture_map;
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = CAPTURE_VERSION;
+    header->flags = CAPTURE_PAYLOADS ? CAPTURE_FLAG_PAYLOADS : 0;
+    header->start_realtime_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    header->data_end = 0;
+    capture_start_ns = capture_monotonic_ns();
+    printf("[CAPTURE] Recording relay traffic to %s (payloads %s).\n", path, CAPTURE_PAYLOADS ? "on" : "off");
+}
+
+// Called from the select() loop and from msquic worker threads.
+static inline void capture_event(uint8_t event, uint16_t session, const void* payload, uint32_t length) {
+    if (capture_map == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&capture_lock);
+    capture_file_header* header = (capture_file_header*)capture_map;
+    capture_record rec = {
+        .t_ns = capture_monotonic_ns() - capture_start_ns,
+        .length = length,
+        .session = session,
+        .event = event
+    };
+    uint64_t payload_bytes = capture_payload_bytes(header, &rec);
+    size_t offset = sizeof(capture_file_header) + header->data_end;
+    size_t end = offset + sizeof(rec) + payload_bytes;
+    if (end > capture_map_size) {
+        if (!capture_grow(end)) {
+            pthread_mutex_unlock(&capture_lock);
+            return;
+        }
+        header = (capture_file_header*)capture_map;
+    }
+    memcpy(capture_map + offset, &rec, sizeof(rec));
+    if (payload_bytes > 0) {
+        memcpy(capture_map + offset + sizeof(rec), payload, length);
+        memset(capture_map + offset + sizeof(rec) + length, 0, payload_bytes - length);
+    }
+    __atomic_store_n(&header->data_end, end - sizeof(capture_file_header), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static inline void capture_close() {
+    if (capture_map == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&capture_lock);
+    size_t used = sizeof(capture_file_header) + ((capture_file_header*)capture_map)->data_end;
+    munmap(capture_map, capture_map_size);
+    capture_map = NULL;
+    if (ftruncate(capture_fd, (off_t)used) < 0) {
+        perror("[CAPTURE][ERROR] ftruncate");
+    }
+    close(capture_fd);
+    capture_fd = -1;
+    pthread_mutex_unlock(&capture_lock);
+    printf("[CAPTURE] Trace closed (%zu bytes).\n", used);
+}
+
+#endif // TRAFFIC_CAPTURE